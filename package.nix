@@ -16,6 +16,7 @@ pkgs.stdenv.mkDerivation {
     pkgs.systemd
     pkgs.libpng
     pkgs.ffmpeg_7
+    pkgs.zstd
   ];
 
   NIX_CFLAGS_COMPILE =
@@ -43,9 +44,20 @@ pkgs.stdenv.mkDerivation {
       $(pkg-config --cflags libavutil) \
       -o image-compare.o
 
+    # Build shared record file module
+    gcc $NIX_CFLAGS_COMPILE -c record-file.c -o record-file.o
+
+    # Build similarity index module
+    gcc $NIX_CFLAGS_COMPILE -c frame-index.c \
+      $(pkg-config --cflags libavutil) \
+      -o frame-index.o
+
+    # Build capture timeline module
+    gcc $NIX_CFLAGS_COMPILE -c timeline.c -o timeline.o
+
     # Build fastshot
-    gcc $NIX_CFLAGS_COMPILE $LDFLAGS fastshot.c image-compare.o \
-      $(pkg-config --cflags --libs libsystemd libpng libavutil) \
+    gcc $NIX_CFLAGS_COMPILE $LDFLAGS fastshot.c image-compare.o record-file.o frame-index.o timeline.o \
+      $(pkg-config --cflags --libs libsystemd libpng libavutil libzstd) \
       -o fastshot
 
   '';
@@ -58,8 +70,14 @@ pkgs.stdenv.mkDerivation {
     echo "Running image comparison unit tests..."
     gcc $NIX_CFLAGS_COMPILE test-image-compare.c image-compare.o \
       $(pkg-config --cflags --libs libavutil) \
-      -o test-image-compare -lm
+      -o test-image-compare -lm -lpthread
     ./test-image-compare
+
+    echo "Running record file, index and timeline unit tests..."
+    gcc $NIX_CFLAGS_COMPILE test-record-file.c record-file.o frame-index.o timeline.o image-compare.o \
+      $(pkg-config --cflags --libs libavutil) \
+      -o test-record-file -lm -lpthread
+    ./test-record-file
   '';
 
   meta = with pkgs.lib; {
@@ -1,13 +1,19 @@
 #define _GNU_SOURCE
 #include <systemd/sd-bus.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <immintrin.h>
 #include <png.h>
 #include <time.h>
@@ -15,12 +21,29 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <zstd.h>
 #include "image-compare.h"
+#include "frame-index.h"
+#include "timeline.h"
+#include "record-file.h"
 
 #define DEFAULT_INTERVAL 45
 #define DEFAULT_THRESHOLD 0.99f
 #define DEFAULT_DIRECTORY "desktop-record"
 #define BGRA_CHANNELS 4
+#define SPOOL_SUBDIR ".spool"
+#define SPOOL_SUFFIX ".bgra.zst"
+#define SPOOL_MAGIC "FSSPOOL1"
+#define SPOOL_ZSTD_LEVEL 1
+#define SPOOL_IDLE_POLL 60 // Seconds between spool rescans / power checks
+#define SPOOL_STOP_TIMEOUT 2 // Seconds shutdown waits for an in-flight encode
+#define DEFAULT_DEBOUNCE_MS 1000
+#define PNG_FAST_LEVEL 1     // zlib level used for live captures
+#define BATCH_DEFAULT_LEVEL 9
+#define BATCH_PROGRESS_FILE ".fastshot-batch"
+#define BATCH_REPORT_INTERVAL 2 // Seconds between throughput reports
+#define TRIGGER_OBJECT_PATH "/org/fastshot/Trigger"
+#define TRIGGER_INTERFACE "org.fastshot.Trigger"
 
 typedef struct {
     uint8_t *data;
@@ -30,13 +53,29 @@ typedef struct {
     size_t size;
 } screenshot_t;
 
+typedef enum {
+    SINK_FILE,      // Path given on the command line (or timestamped default)
+    SINK_FD,        // stdout ("-") or an inherited fd (--fd)
+    SINK_MEMFD,     // Sealed memfd sent over a unix socket (--send-memfd)
+} output_sink_t;
+
 typedef struct {
     const char *directory;
     int interval;
     float threshold;
     int verbose;
     int loop_mode;
+    int threads;
+    int defer;
+    int idle_pause;
+    int index;
+    int trigger;
+    int debounce_ms;
+    int timeline;
     const char *output_file;
+    output_sink_t sink;
+    int output_fd;
+    const char *memfd_socket;
 } config_t;
 
 static volatile sig_atomic_t running = 1;
@@ -46,7 +85,17 @@ static config_t config = {
     .threshold = DEFAULT_THRESHOLD,
     .verbose = 0,
     .loop_mode = 0,
-    .output_file = NULL
+    .threads = 1,
+    .defer = 0,
+    .idle_pause = 1,
+    .index = 1,
+    .trigger = 0,
+    .debounce_ms = DEFAULT_DEBOUNCE_MS,
+    .timeline = 1,
+    .output_file = NULL,
+    .sink = SINK_FILE,
+    .output_fd = -1,
+    .memfd_socket = NULL
 };
 
 static void signal_handler(int sig) {
@@ -61,11 +110,64 @@ static void print_usage(const char *prog) {
     fprintf(stderr, "  -d, --directory DIR    Target directory for loop mode (default: ~/desktop-record)\n");
     fprintf(stderr, "  -i, --interval SECS    Screenshot interval for loop mode (default: 45)\n");
     fprintf(stderr, "  -t, --threshold FLOAT  Similarity threshold 0-1 for loop mode (default: 0.99)\n");
+    fprintf(stderr, "  -j, --threads N        Threads for comparing large frames (default: 1, 0 = all CPUs)\n");
+    fprintf(stderr, "  --fd N                 Single shot: stream the PNG to inherited fd N\n");
+    fprintf(stderr, "  --send-memfd SOCK      Single shot: send a sealed memfd with the PNG over SOCK\n");
+    fprintf(stderr, "                         (a connected socket fd number or a unix socket path)\n");
+    fprintf(stderr, "  --defer                Loop mode: spool frames as zstd-compressed raw BGRA and\n");
+    fprintf(stderr, "                         encode PNGs in the background when the CPU is idle\n");
+    fprintf(stderr, "  --no-idle-pause        Loop mode: keep capturing while locked, idle or blanked\n");
+    fprintf(stderr, "  --trigger              Loop mode: capture after window focus and virtual desktop\n");
+    fprintf(stderr, "                         changes; -i becomes the fallback interval\n");
+    fprintf(stderr, "  --debounce MS          Delay after the last trigger event (default: %d)\n", DEFAULT_DEBOUNCE_MS);
+    fprintf(stderr, "  --no-index             Loop mode: do not append saved frames to %s\n", FRAME_INDEX_FILENAME);
+    fprintf(stderr, "  --no-timeline          Loop mode: do not record captures in %s\n", TIMELINE_FILENAME);
     fprintf(stderr, "  -v, --verbose          Enable verbose logging\n");
     fprintf(stderr, "  -h, --help             Show this help\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Single shot mode: %s [output_file]\n", prog);
+    fprintf(stderr, "To stdout:        %s - | wl-copy\n", prog);
     fprintf(stderr, "Loop mode:        %s --loop [options]\n", prog);
+    fprintf(stderr, "Find similar:     %s query [options] [image.png]\n", prog);
+    fprintf(stderr, "Transcode:        %s batch [options] SRC_DIR DST_DIR\n", prog);
+    fprintf(stderr, "Capture history:  %s timeline [options]\n", prog);
+}
+
+// Thread count option: 0 means all CPUs, anything non-numeric is rejected
+static int parse_thread_count(const char *text, int *out) {
+    char *end = NULL;
+    long n = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || n < 0 || n > INT32_MAX) {
+        fprintf(stderr, "Invalid thread count: %s\n", text);
+        return -1;
+    }
+    *out = (int)n;
+    return 0;
+}
+
+// Parse a whole decimal integer within [min, max], rejecting trailing junk
+static int parse_int_option(const char *text, long min, long max, const char *what, int *out) {
+    char *end = NULL;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno == ERANGE || n < min || n > max) {
+        fprintf(stderr, "Invalid %s: %s\n", what, text);
+        return -1;
+    }
+    *out = (int)n;
+    return 0;
+}
+
+static int set_default_directory(void) {
+    const char *home = getenv("HOME");
+    if (!home) {
+        fprintf(stderr, "HOME environment variable not set\n");
+        return -1;
+    }
+    static char default_dir[4096];
+    snprintf(default_dir, sizeof(default_dir), "%s/%s", home, DEFAULT_DIRECTORY);
+    config.directory = default_dir;
+    return 0;
 }
 
 static int parse_args(int argc, char **argv) {
@@ -74,14 +176,23 @@ static int parse_args(int argc, char **argv) {
         {"directory", required_argument, 0, 'd'},
         {"interval", required_argument, 0, 'i'},
         {"threshold", required_argument, 0, 't'},
+        {"threads", required_argument, 0, 'j'},
         {"verbose", no_argument, 0, 'v'},
+        {"defer", no_argument, 0, 'P'},
+        {"no-idle-pause", no_argument, 0, 'I'},
+        {"no-index", no_argument, 0, 'N'},
+        {"no-timeline", no_argument, 0, 'L'},
+        {"trigger", no_argument, 0, 'E'},
+        {"debounce", required_argument, 0, 'B'},
+        {"fd", required_argument, 0, 'F'},
+        {"send-memfd", required_argument, 0, 'M'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
 
     int opt;
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "d:i:t:vDh", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:i:t:j:vDh", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'l':
                 config.loop_mode = 1;
@@ -90,9 +201,7 @@ static int parse_args(int argc, char **argv) {
                 config.directory = optarg;
                 break;
             case 'i':
-                config.interval = atoi(optarg);
-                if (config.interval <= 0) {
-                    fprintf(stderr, "Invalid interval: %s\n", optarg);
+                if (parse_int_option(optarg, 1, INT32_MAX, "interval", &config.interval) < 0) {
                     return -1;
                 }
                 break;
@@ -103,6 +212,47 @@ static int parse_args(int argc, char **argv) {
                     return -1;
                 }
                 break;
+            case 'j':
+                if (parse_thread_count(optarg, &config.threads) < 0) {
+                    return -1;
+                }
+                break;
+            case 'P':
+                config.defer = 1;
+                break;
+            case 'I':
+                config.idle_pause = 0;
+                break;
+            case 'N':
+                config.index = 0;
+                break;
+            case 'L':
+                config.timeline = 0;
+                break;
+            case 'E':
+                config.trigger = 1;
+                break;
+            case 'B':
+                if (parse_int_option(optarg, 0, 3600 * 1000, "debounce", &config.debounce_ms) < 0) {
+                    return -1;
+                }
+                break;
+            case 'F': {
+                char *end = NULL;
+                long fd = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT32_MAX ||
+                    fcntl((int)fd, F_GETFD) < 0) {
+                    fprintf(stderr, "Invalid file descriptor: %s\n", optarg);
+                    return -1;
+                }
+                config.sink = SINK_FD;
+                config.output_fd = (int)fd;
+                break;
+            }
+            case 'M':
+                config.sink = SINK_MEMFD;
+                config.memfd_socket = optarg;
+                break;
             case 'v':
                 config.verbose = 1;
                 break;
@@ -118,18 +268,25 @@ static int parse_args(int argc, char **argv) {
     // Handle output file for single shot mode
     if (!config.loop_mode && optind < argc) {
         config.output_file = argv[optind];
+        if (config.sink == SINK_FILE && strcmp(config.output_file, "-") == 0) {
+            config.sink = SINK_FD;
+            config.output_fd = STDOUT_FILENO;
+        }
+    }
+    
+    if (config.defer && !config.loop_mode) {
+        fprintf(stderr, "--defer only applies to loop mode\n");
+        return -1;
+    }
+    
+    if (config.loop_mode && config.sink != SINK_FILE) {
+        fprintf(stderr, "--fd and --send-memfd only apply to single shot mode\n");
+        return -1;
     }
 
     // Set default directory if not specified for loop mode
     if (config.loop_mode && !config.directory) {
-        const char *home = getenv("HOME");
-        if (!home) {
-            fprintf(stderr, "HOME environment variable not set\n");
-            return -1;
-        }
-        static char default_dir[4096];
-        snprintf(default_dir, sizeof(default_dir), "%s/%s", home, DEFAULT_DIRECTORY);
-        config.directory = default_dir;
+        return set_default_directory();
     }
 
     return 0;
@@ -271,57 +428,101 @@ static int capture_screenshot(sd_bus *bus, screenshot_t *shot) {
     return 0;
 }
 
-// Async PNG writer thread data
+// Streaming PNG sink: libpng's small chunk writes are gathered into a
+// PNG_SINK_BUFFER sized buffer and passed on as soon as it fills, so a
+// reader on a pipe starts before encoding ends without paying a syscall
+// per chunk header and CRC
+#define PNG_SINK_BUFFER (64 * 1024)
+
 typedef struct {
-    uint8_t *data;
-    uint32_t width;
-    uint32_t height;
-    uint32_t stride;
-    char filename[4096];
-} png_write_task_t;
+    int fd;
+    int error;
+    size_t used;
+    uint8_t buffer[PNG_SINK_BUFFER];
+} png_sink_t;
 
-static void *png_writer_thread(void *arg) {
-    png_write_task_t *task = (png_write_task_t *)arg;
-    FILE *fp = fopen(task->filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s for writing\n", task->filename);
-        free(task->data);
-        free(task);
-        return NULL;
+static int png_sink_emit(png_sink_t *sink, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(sink->fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            sink->error = errno;
+            return -errno;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static int png_sink_drain(png_sink_t *sink) {
+    int r = png_sink_emit(sink, sink->buffer, sink->used);
+    sink->used = 0;
+    return r;
+}
+
+static void png_sink_write(png_structp png, png_bytep data, png_size_t length) {
+    png_sink_t *sink = (png_sink_t *)png_get_io_ptr(png);
+    
+    if (sink->used + length > sizeof(sink->buffer) && png_sink_drain(sink) < 0) {
+        png_error(png, "write failed");
+    }
+    if (length >= sizeof(sink->buffer)) {
+        if (png_sink_emit(sink, data, length) < 0) {
+            png_error(png, "write failed");
+        }
+        return;
+    }
+    memcpy(sink->buffer + sink->used, data, length);
+    sink->used += length;
+}
+
+static void png_sink_flush(png_structp png) {
+    png_sink_t *sink = (png_sink_t *)png_get_io_ptr(png);
+    if (png_sink_drain(sink) < 0) {
+        png_error(png, "write failed");
+    }
+}
+
+// Encode a BGRA frame as PNG into fd with the given zlib level. Above
+// PNG_FAST_LEVEL, adaptive row filters are enabled as well, trading time
+// for size. Returns 0 or -errno.
+static int write_png_fd(int fd, const uint8_t *data, uint32_t width,
+                        uint32_t height, uint32_t stride, int level) {
+    png_sink_t *sink = malloc(sizeof(*sink));
+    if (!sink) {
+        return -ENOMEM;
     }
+    sink->fd = fd;
+    sink->error = 0;
+    sink->used = 0;
     
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
-        fclose(fp);
-        free(task->data);
-        free(task);
-        return NULL;
+        free(sink);
+        return -ENOMEM;
     }
     
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        free(task->data);
-        free(task);
-        return NULL;
+        free(sink);
+        return -ENOMEM;
     }
     
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        free(task->data);
-        free(task);
-        return NULL;
+        int err = sink->error ? -sink->error : -EIO;
+        free(sink);
+        return err;
     }
     
-    png_init_io(png, fp);
+    png_set_write_fn(png, sink, png_sink_write, png_sink_flush);
     
-    // Fast compression settings
-    png_set_compression_level(png, 1);
-    png_set_filter(png, 0, PNG_FILTER_NONE);
+    png_set_compression_level(png, level);
+    png_set_filter(png, 0, level <= PNG_FAST_LEVEL ? PNG_FILTER_NONE : PNG_ALL_FILTERS);
     
-    png_set_IHDR(png, info, task->width, task->height, 8, PNG_COLOR_TYPE_RGBA,
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGBA,
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
     
@@ -329,350 +530,2370 @@ static void *png_writer_thread(void *arg) {
     png_set_bgr(png);
     
     // Write rows
-    for (uint32_t y = 0; y < task->height; y++) {
-        png_write_row(png, task->data + y * task->stride);
+    for (uint32_t y = 0; y < height; y++) {
+        png_write_row(png, data + y * stride);
     }
     
     png_write_end(png, NULL);
     png_destroy_write_struct(&png, &info);
-    fclose(fp);
     
-    if (config.verbose) {
-        printf("Saved: %s\n", task->filename);
-        fflush(stdout);
+    int r = png_sink_drain(sink);
+    free(sink);
+    return r;
+}
+
+// Decode a PNG file into a malloc'ed BGRA buffer (stride = width * 4).
+// Unlike captured frames, shot->data must be released with free().
+static int read_png_bgra(const char *path, screenshot_t *shot) {
+    FILE *fp = fopen(path, "rbe");
+    if (!fp) {
+        return -errno;
     }
     
-    free(task->data);
-    free(task);
-    return NULL;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        fclose(fp);
+        return -ENOMEM;
+    }
+    
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        fclose(fp);
+        return -ENOMEM;
+    }
+    
+    uint8_t *volatile data = NULL;
+    png_bytep *volatile rows = NULL;
+    
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fp);
+        free(data);
+        free(rows);
+        return -EBADMSG;
+    }
+    
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    
+    uint32_t width = png_get_image_width(png, info);
+    uint32_t height = png_get_image_height(png, info);
+    int color = png_get_color_type(png, info);
+    
+    // Normalize everything to 8-bit BGRA, the layout KWin hands us
+    if (color == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+    if (png_get_bit_depth(png, info) == 16) png_set_strip_16(png);
+    if (color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(png);
+    }
+    if (!(color & PNG_COLOR_MASK_ALPHA) && !png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    }
+    png_set_bgr(png);
+    png_read_update_info(png, info);
+    
+    uint32_t stride = width * BGRA_CHANNELS;
+    size_t size = (size_t)stride * height;
+    data = malloc(size);
+    rows = malloc(height * sizeof(png_bytep));
+    if (!data || !rows) {
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fp);
+        free(data);
+        free(rows);
+        return -ENOMEM;
+    }
+    
+    for (uint32_t y = 0; y < height; y++) {
+        rows[y] = data + (size_t)y * stride;
+    }
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+    
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    free(rows);
+    
+    shot->data = data;
+    shot->width = width;
+    shot->height = height;
+    shot->stride = stride;
+    shot->size = size;
+    return 0;
 }
 
-static void save_screenshot_async(const screenshot_t *shot, const char *filename) {
-    png_write_task_t *task = malloc(sizeof(png_write_task_t));
-    if (!task) {
-        fprintf(stderr, "Failed to allocate PNG write task\n");
-        return;
-    }
+// Async PNG writer thread data
+typedef struct {
+    uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    time_t timestamp;
+    char filename[4096];
+} png_write_task_t;
 
-    // Copy image data - use aligned allocation for AVX compatibility
-    // Align to 32 bytes for AVX2 instructions
-    size_t aligned_size = (shot->size + 31) & ~31;  // Round up to nearest 32-byte boundary
-    task->data = aligned_alloc(32, aligned_size);
-    if (!task->data) {
-        fprintf(stderr, "Failed to allocate image buffer\n");
-        free(task);
+static void index_saved_frame(const png_write_task_t *task) {
+    if (!config.index) {
         return;
     }
-
-    memcpy(task->data, shot->data, shot->size);
-    task->width = shot->width;
-    task->height = shot->height;
-    task->stride = shot->stride;
-    strncpy(task->filename, filename, sizeof(task->filename) - 1);
-    task->filename[sizeof(task->filename) - 1] = '\0'; // Ensure null termination
     
-    // Create detached thread for async writing
-    pthread_t thread;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    frame_index_record_t record;
+    frame_index_fill(&record, task->data, task->width, task->height, task->stride,
+                     task->timestamp, task->filename);
+    int r = frame_index_append(config.directory, &record);
+    if (r < 0) {
+        fprintf(stderr, "Failed to update %s: %s\n", FRAME_INDEX_FILENAME, strerror(-r));
+    }
+}
+
+static void *png_writer_thread(void *arg) {
+    png_write_task_t *task = (png_write_task_t *)arg;
     
-    if (pthread_create(&thread, &attr, png_writer_thread, task) != 0) {
-        fprintf(stderr, "Failed to create PNG writer thread\n");
+    int fd = open(task->filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s for writing\n", task->filename);
         free(task->data);
         free(task);
+        return NULL;
     }
     
-    pthread_attr_destroy(&attr);
+    int r = write_png_fd(fd, task->data, task->width, task->height, task->stride,
+                         PNG_FAST_LEVEL);
+    close(fd);
+    
+    if (r < 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", task->filename, strerror(-r));
+    } else {
+        // Only index frames that actually made it to disk
+        index_saved_frame(task);
+        if (config.verbose) {
+            printf("Saved: %s\n", task->filename);
+            fflush(stdout);
+        }
+    }
+    
+    free(task->data);
+    free(task);
+    return NULL;
 }
 
-static float compare_screenshots(const screenshot_t *shot1, const screenshot_t *shot2) {
-    if (shot1->width != shot2->width || shot1->height != shot2->height || shot1->stride != shot2->stride) {
-        return 0.0f; // Different dimensions = not similar
-    }
+// Deferred encoding spool.
+//
+// Accepted frames are written to <directory>/.spool as a spool_header_t
+// followed by one zstd frame of the raw BGRA rows, which costs little more
+// than the memcpy. A SCHED_IDLE drain thread turns them into the final PNGs
+// oldest first, only when nothing else wants the CPU and while on AC power.
+// Entries are published with rename(), so after a crash the spool only
+// holds complete frames plus *.tmp leftovers, which are discarded.
+typedef struct {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t raw_size;
+} spool_header_t;
+
+static struct {
+    char dir[4096];
+    pthread_t thread;
+    int started;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} spool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int spool_write(const png_write_task_t *task) {
+    const char *base = strrchr(task->filename, '/');
+    base = base ? base + 1 : task->filename;
     
-    float mse = calculate_mse_bgra(shot1->data, shot2->data, 
-                                   shot1->width, shot1->height, 
-                                   shot1->stride, shot2->stride);
+    char path[4096 + 256];
+    char tmp[4096 + 256 + 8];
+    int n = snprintf(path, sizeof(path), "%s/%s%s", spool.dir, base, SPOOL_SUFFIX);
+    if (n < 0 || (size_t)n >= sizeof(path)) return -ENAMETOOLONG;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
     
-    if (mse < 0) {
-        // Error in calculation
-        return 0.0f;
+    size_t raw_size = (size_t)task->stride * task->height;
+    size_t bound = ZSTD_compressBound(raw_size);
+    uint8_t *packed = malloc(bound);
+    if (!packed) {
+        return -ENOMEM;
     }
     
-    return mse_to_similarity(mse);
-}
-
-static int check_compositor_ready(sd_bus *bus) {
-    sd_bus_error err = SD_BUS_ERROR_NULL;
-    sd_bus_message *reply = NULL;
-    int r = 0;
+    size_t packed_size = ZSTD_compress(packed, bound, task->data, raw_size, SPOOL_ZSTD_LEVEL);
+    if (ZSTD_isError(packed_size)) {
+        fprintf(stderr, "zstd compression failed: %s\n", ZSTD_getErrorName(packed_size));
+        free(packed);
+        return -EIO;
+    }
     
-    // Try to check if the compositor is running
-    r = sd_bus_call_method(bus,
-        "org.kde.KWin", "/Compositor",
-        "org.freedesktop.DBus.Properties", "Get",
-        &err, &reply,
-        "ss",
-        "org.kde.kwin.Compositing", "active"
-    );
+    spool_header_t header = {
+        .width = task->width,
+        .height = task->height,
+        .stride = task->stride,
+        .raw_size = raw_size,
+    };
+    memcpy(header.magic, SPOOL_MAGIC, sizeof(header.magic));
+    
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        int err = errno;
+        free(packed);
+        return -err;
+    }
+    
+    int r = write_all(fd, &header, sizeof(header));
+    if (r == 0) {
+        r = write_all(fd, packed, packed_size);
+    }
+    close(fd);
+    free(packed);
     
+    if (r == 0 && rename(tmp, path) < 0) {
+        r = -errno;
+    }
     if (r < 0) {
-        sd_bus_error_free(&err);
-        sd_bus_message_unref(reply);
-        return 0; // Assume not ready if we can't check
+        unlink(tmp);
+        return r;
     }
     
-    sd_bus_message_unref(reply);
-    sd_bus_error_free(&err);
-    return 1;
+    if (config.verbose) {
+        printf("Spooled: %s (%zu -> %zu bytes)\n", base, raw_size, packed_size + sizeof(header));
+        fflush(stdout);
+    }
+    
+    pthread_mutex_lock(&spool.lock);
+    pthread_cond_signal(&spool.cond);
+    pthread_mutex_unlock(&spool.lock);
+    return 0;
 }
 
-static int run_loop_mode(sd_bus *bus) {
-    screenshot_t current = {
-        .data = NULL,
-        .width = 0,
-        .height = 0,
-        .stride = 0,
-        .size = 0
-    };
-    screenshot_t last_saved = {
-        .data = NULL,
-        .width = 0,
-        .height = 0,
-        .stride = 0,
-        .size = 0
-    };
-    int first_shot = 1;
+static void *spool_writer_thread(void *arg) {
+    png_write_task_t *task = (png_write_task_t *)arg;
     
-    if (config.verbose) {
-        printf("Starting screenshot loop:\n");
-        printf("  Directory: %s\n", config.directory);
-        printf("  Interval: %d seconds\n", config.interval);
-        printf("  Threshold: %.2f\n", config.threshold);
+    int r = spool_write(task);
+    if (r < 0) {
+        fprintf(stderr, "Failed to spool %s: %s\n", task->filename, strerror(-r));
+    } else {
+        index_saved_frame(task);
+    }
+    free(task->data);
+    free(task);
+    return NULL;
+}
+
+// Returns 0 only when the machine has a battery and no mains supply is online
+static int on_ac_power(void) {
+    DIR *d = opendir("/sys/class/power_supply");
+    if (!d) {
+        return 1;
     }
     
-    // Wait for compositor to be ready
-    int compositor_wait_count = 0;
+    int have_battery = 0;
+    int mains_online = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        
+        char path[512];
+        char value[32] = {0};
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%s/type", ent->d_name);
+        FILE *fp = fopen(path, "re");
+        if (!fp) continue;
+        if (!fgets(value, sizeof(value), fp)) value[0] = '\0';
+        fclose(fp);
+        
+        if (strncmp(value, "Battery", 7) == 0) {
+            have_battery = 1;
+        } else if (strncmp(value, "Mains", 5) == 0) {
+            snprintf(path, sizeof(path), "/sys/class/power_supply/%s/online", ent->d_name);
+            fp = fopen(path, "re");
+            if (!fp) continue;
+            if (fgets(value, sizeof(value), fp) && value[0] == '1') {
+                mains_online = 1;
+            }
+            fclose(fp);
+        }
+    }
+    closedir(d);
+    
+    return mains_online || !have_battery;
+}
+
+static int is_spool_entry(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix = strlen(SPOOL_SUFFIX);
+    return len > suffix && strcmp(name + len - suffix, SPOOL_SUFFIX) == 0;
+}
+
+// Pick the oldest spooled frame (filenames are timestamps, so sort by name)
+static int spool_oldest(char *name, size_t size) {
+    DIR *d = opendir(spool.dir);
+    if (!d) {
+        return 0;
+    }
+    
+    int found = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (!is_spool_entry(ent->d_name)) continue;
+        if (!found || strcmp(ent->d_name, name) < 0) {
+            snprintf(name, size, "%s", ent->d_name);
+            found = 1;
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+static int spool_drain_one(const char *name) {
+    char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", spool.dir, name);
+    
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(spool_header_t)) {
+        close(fd);
+        return -EBADMSG;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    
+    spool_header_t header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, SPOOL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.stride < header.width * BGRA_CHANNELS ||
+        header.raw_size != (uint64_t)header.stride * header.height) {
+        munmap(map, st.st_size);
+        return -EBADMSG;
+    }
+    
+    uint8_t *raw = malloc(header.raw_size);
+    if (!raw) {
+        munmap(map, st.st_size);
+        return -ENOMEM;
+    }
+    
+    size_t n = ZSTD_decompress(raw, header.raw_size,
+                               (const uint8_t *)map + sizeof(header),
+                               st.st_size - sizeof(header));
+    munmap(map, st.st_size);
+    if (ZSTD_isError(n) || n != header.raw_size) {
+        free(raw);
+        return -EBADMSG;
+    }
+    
+    // <directory>/<name without suffix>, written via .part + rename so a
+    // crash mid-encode just means the frame is encoded again next time
+    char final[4096 + 256];
+    char part[4096 + 256 + 8];
+    snprintf(final, sizeof(final), "%s/%.*s", config.directory,
+             (int)(strlen(name) - strlen(SPOOL_SUFFIX)), name);
+    snprintf(part, sizeof(part), "%s.part", final);
+    
+    int out = open(part, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+    if (out < 0) {
+        int err = errno;
+        free(raw);
+        return -err;
+    }
+    
+    int r = write_png_fd(out, raw, header.width, header.height, header.stride,
+                         PNG_FAST_LEVEL);
+    close(out);
+    free(raw);
+    
+    if (r == 0 && rename(part, final) < 0) {
+        r = -errno;
+    }
+    if (r < 0) {
+        unlink(part);
+        return r;
+    }
+    
+    unlink(path);
+    
+    if (config.verbose) {
+        printf("Saved: %s\n", final);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void *spool_drain_thread(void *arg) {
+    (void)arg;
+    
+    // Only run when no other thread wants the CPU
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    
+    char name[256];
+    for (;;) {
+        pthread_mutex_lock(&spool.lock);
+        int stop = spool.stop;
+        pthread_mutex_unlock(&spool.lock);
+        if (stop) break;
+        
+        int have_work = on_ac_power() && spool_oldest(name, sizeof(name));
+        if (have_work) {
+            int r = spool_drain_one(name);
+            if (r == -EBADMSG) {
+                // Keep it around for inspection but out of the queue so the
+                // entries behind it still get encoded
+                char path[4096 + 256];
+                char bad[4096 + 256 + 8];
+                snprintf(path, sizeof(path), "%s/%s", spool.dir, name);
+                snprintf(bad, sizeof(bad), "%s.bad", path);
+                fprintf(stderr, "Corrupt spool entry %s, moved aside\n", name);
+                rename(path, bad);
+            } else if (r < 0) {
+                // Disk full, out of memory and the like: keep the entry
+                // queued and back off until the next poll
+                fprintf(stderr, "Failed to encode %s: %s\n", name, strerror(-r));
+                have_work = 0;
+            }
+            if (have_work) continue;
+        }
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SPOOL_IDLE_POLL;
+        pthread_mutex_lock(&spool.lock);
+        if (!spool.stop) {
+            pthread_cond_timedwait(&spool.cond, &spool.lock, &deadline);
+        }
+        pthread_mutex_unlock(&spool.lock);
+    }
+    
+    return NULL;
+}
+
+static int spool_start(void) {
+    snprintf(spool.dir, sizeof(spool.dir), "%s/%s", config.directory, SPOOL_SUBDIR);
+    if (ensure_directory(spool.dir) < 0) {
+        return -1;
+    }
+    
+    // Crash recovery: drop half-written spool entries and half-encoded PNGs;
+    // complete entries are picked up by the drain thread as usual
+    const char *dirs[] = { spool.dir, config.directory };
+    const char *suffixes[] = { ".tmp", ".part" };
+    for (int i = 0; i < 2; i++) {
+        DIR *d = opendir(dirs[i]);
+        if (!d) continue;
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            size_t len = strlen(ent->d_name);
+            size_t slen = strlen(suffixes[i]);
+            if (len > slen && strcmp(ent->d_name + len - slen, suffixes[i]) == 0) {
+                unlinkat(dirfd(d), ent->d_name, 0);
+            }
+        }
+        closedir(d);
+    }
+    
+    spool.stop = 0;
+    if (pthread_create(&spool.thread, NULL, spool_drain_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to create spool drain thread\n");
+        return -1;
+    }
+    spool.started = 1;
+    return 0;
+}
+
+static void spool_stop(void) {
+    if (!spool.started) {
+        return;
+    }
+    
+    pthread_mutex_lock(&spool.lock);
+    spool.stop = 1;
+    pthread_cond_signal(&spool.cond);
+    pthread_mutex_unlock(&spool.lock);
+    
+    // An encode in flight would otherwise only finish once the CPU goes
+    // idle, holding up shutdown for as long as we stay busy. Raising the
+    // policy may be refused (RLIMIT_NICE), so don't wait forever either:
+    // the entry is only removed after its PNG is published, and the next
+    // run discards the partial file and encodes it again
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(spool.thread, SCHED_OTHER, &param);
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SPOOL_STOP_TIMEOUT;
+    if (pthread_timedjoin_np(spool.thread, NULL, &deadline) != 0) {
+        fprintf(stderr, "Leaving spool encode unfinished, it resumes on next start\n");
+        pthread_detach(spool.thread);
+    }
+    spool.started = 0;
+}
+
+static void save_screenshot_async(const screenshot_t *shot, const char *filename,
+                                  time_t timestamp) {
+    png_write_task_t *task = malloc(sizeof(png_write_task_t));
+    if (!task) {
+        fprintf(stderr, "Failed to allocate PNG write task\n");
+        return;
+    }
+
+    // Copy image data - use aligned allocation for AVX compatibility
+    // Align to 32 bytes for AVX2 instructions
+    size_t aligned_size = (shot->size + 31) & ~31;  // Round up to nearest 32-byte boundary
+    task->data = aligned_alloc(32, aligned_size);
+    if (!task->data) {
+        fprintf(stderr, "Failed to allocate image buffer\n");
+        free(task);
+        return;
+    }
+
+    memcpy(task->data, shot->data, shot->size);
+    task->width = shot->width;
+    task->height = shot->height;
+    task->stride = shot->stride;
+    task->timestamp = timestamp;
+    strncpy(task->filename, filename, sizeof(task->filename) - 1);
+    task->filename[sizeof(task->filename) - 1] = '\0'; // Ensure null termination
+    
+    // Create detached thread for async writing
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    void *(*writer)(void *) = config.defer ? spool_writer_thread : png_writer_thread;
+    if (pthread_create(&thread, &attr, writer, task) != 0) {
+        fprintf(stderr, "Failed to create PNG writer thread\n");
+        free(task->data);
+        free(task);
+    }
+    
+    pthread_attr_destroy(&attr);
+}
+
+// Similarity of two frames. With tile_mse, the MSE of every cell of the
+// TIMELINE_TILES_X x TIMELINE_TILES_Y grid is reported from the same pass;
+// frames that cannot be compared count as changed everywhere.
+static float compare_screenshots(const screenshot_t *shot1, const screenshot_t *shot2,
+                                 float *tile_mse) {
+    float mse = -1.0f;
+    
+    if (shot1->width == shot2->width && shot1->height == shot2->height &&
+        shot1->stride == shot2->stride) {
+        if (tile_mse) {
+            mse = calculate_mse_tiles_bgra(shot1->data, shot2->data,
+                                           shot1->width, shot1->height,
+                                           shot1->stride, shot2->stride,
+                                           TIMELINE_TILES_X, TIMELINE_TILES_Y, tile_mse);
+        } else {
+            mse = calculate_mse_bgra(shot1->data, shot2->data, 
+                                     shot1->width, shot1->height, 
+                                     shot1->stride, shot2->stride);
+        }
+    }
+    
+    if (mse < 0) {
+        // Different dimensions or error in calculation = not similar
+        if (tile_mse) {
+            for (int t = 0; t < TIMELINE_TILES; t++) {
+                tile_mse[t] = 1.0f;
+            }
+        }
+        return 0.0f;
+    }
+    
+    return mse_to_similarity(mse);
+}
+
+static int check_compositor_ready(sd_bus *bus) {
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    int r = 0;
+    
+    // Try to check if the compositor is running
+    r = sd_bus_call_method(bus,
+        "org.kde.KWin", "/Compositor",
+        "org.freedesktop.DBus.Properties", "Get",
+        &err, &reply,
+        "ss",
+        "org.kde.kwin.Compositing", "active"
+    );
+    
+    if (r < 0) {
+        sd_bus_error_free(&err);
+        sd_bus_message_unref(reply);
+        return 0; // Assume not ready if we can't check
+    }
+    
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&err);
+    return 1;
+}
+
+// Session activity tracking.
+//
+// logind's IdleHint/LockedHint on our graphical session (system bus) and
+// the KDE screensaver's ActiveChanged signal (session bus) are watched so
+// the loop can stop capturing frames that would only ever be discarded.
+static struct {
+    sd_bus *system_bus;
+    char session_path[256];
+    int idle;
+    int locked;
+    int screensaver;
+    int session_lost; // Session bus failed, stop polling it
+} activity;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int activity_is_active(void) {
+    return !activity.idle && !activity.locked && !activity.screensaver;
+}
+
+static void activity_refresh_session(void) {
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    int value = 0;
+    
+    if (sd_bus_get_property_trivial(activity.system_bus, "org.freedesktop.login1",
+                                    activity.session_path, "org.freedesktop.login1.Session",
+                                    "IdleHint", &err, 'b', &value) >= 0) {
+        activity.idle = value;
+    }
+    sd_bus_error_free(&err);
+    
+    if (sd_bus_get_property_trivial(activity.system_bus, "org.freedesktop.login1",
+                                    activity.session_path, "org.freedesktop.login1.Session",
+                                    "LockedHint", &err, 'b', &value) >= 0) {
+        activity.locked = value;
+    }
+    sd_bus_error_free(&err);
+}
+
+static int on_session_properties(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)userdata;
+    (void)ret_error;
+    const char *iface = NULL;
+    const char *key = NULL;
+    int refresh = 0;
+    
+    if (sd_bus_message_read(m, "s", &iface) < 0 ||
+        strcmp(iface, "org.freedesktop.login1.Session") != 0) {
+        return 0;
+    }
+    
+    if (sd_bus_message_enter_container(m, 'a', "{sv}") < 0) {
+        return 0;
+    }
+    while (sd_bus_message_enter_container(m, 'e', "sv") > 0) {
+        int value = 0;
+        sd_bus_message_read(m, "s", &key);
+        if (strcmp(key, "IdleHint") == 0) {
+            sd_bus_message_read(m, "v", "b", &value);
+            activity.idle = value;
+        } else if (strcmp(key, "LockedHint") == 0) {
+            sd_bus_message_read(m, "v", "b", &value);
+            activity.locked = value;
+        } else {
+            sd_bus_message_skip(m, "v");
+        }
+        sd_bus_message_exit_container(m);
+    }
+    sd_bus_message_exit_container(m);
+    
+    // Invalidated properties carry no value, so ask for them again
+    if (sd_bus_message_enter_container(m, 'a', "s") > 0) {
+        while (sd_bus_message_read(m, "s", &key) > 0) {
+            if (strcmp(key, "IdleHint") == 0 || strcmp(key, "LockedHint") == 0) {
+                refresh = 1;
+            }
+        }
+        sd_bus_message_exit_container(m);
+    }
+    if (refresh) {
+        activity_refresh_session();
+    }
+    
+    return 0;
+}
+
+static int on_screensaver_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)userdata;
+    (void)ret_error;
+    int value = 0;
+    
+    if (sd_bus_message_read(m, "b", &value) >= 0) {
+        activity.screensaver = value;
+    }
+    return 0;
+}
+
+// Find the graphical session we belong to. A systemd user service is not
+// part of any session, so fall back to the user's display session.
+static int activity_find_session(void) {
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *path = NULL;
+    int r = 0;
+    
+    r = sd_bus_call_method(activity.system_bus,
+        "org.freedesktop.login1", "/org/freedesktop/login1",
+        "org.freedesktop.login1.Manager", "GetSessionByPID",
+        &err, &reply, "u", (uint32_t)getpid());
+    if (r >= 0) {
+        r = sd_bus_message_read(reply, "o", &path);
+    } else {
+        sd_bus_error_free(&err);
+        sd_bus_message_unref(reply);
+        reply = NULL;
+        
+        const char *id = NULL;
+        r = sd_bus_get_property(activity.system_bus, "org.freedesktop.login1",
+                                "/org/freedesktop/login1/user/self",
+                                "org.freedesktop.login1.User", "Display",
+                                &err, &reply, "(so)");
+        if (r >= 0) {
+            r = sd_bus_message_read(reply, "(so)", &id, &path);
+        }
+    }
+    
+    if (r >= 0 && path && strcmp(path, "/") != 0) {
+        snprintf(activity.session_path, sizeof(activity.session_path), "%s", path);
+        r = 0;
+    } else if (r >= 0) {
+        r = -ENOENT;
+    }
+    
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&err);
+    return r;
+}
+
+static void activity_init(sd_bus *bus) {
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    int r = 0;
+    
+    if (sd_bus_open_system(&activity.system_bus) >= 0) {
+        if (activity_find_session() >= 0) {
+            r = sd_bus_match_signal(activity.system_bus, NULL,
+                "org.freedesktop.login1", activity.session_path,
+                "org.freedesktop.DBus.Properties", "PropertiesChanged",
+                on_session_properties, NULL);
+            if (r >= 0) {
+                activity_refresh_session();
+            }
+        } else {
+            r = -ENOENT;
+        }
+        
+        if (r < 0) {
+            if (config.verbose) {
+                fprintf(stderr, "No logind session to watch, ignoring idle/lock hints\n");
+            }
+            activity.system_bus = sd_bus_flush_close_unref(activity.system_bus);
+        }
+    }
+    
+    r = sd_bus_match_signal(bus, NULL, NULL, "/ScreenSaver",
+        "org.freedesktop.ScreenSaver", "ActiveChanged",
+        on_screensaver_changed, NULL);
+    if (r >= 0) {
+        r = sd_bus_call_method(bus,
+            "org.freedesktop.ScreenSaver", "/ScreenSaver",
+            "org.freedesktop.ScreenSaver", "GetActive",
+            &err, &reply, "");
+        if (r >= 0) {
+            int value = 0;
+            if (sd_bus_message_read(reply, "b", &value) >= 0) {
+                activity.screensaver = value;
+            }
+        }
+    }
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&err);
+    
+    if (config.verbose) {
+        printf("  Session: %s%s\n",
+               activity.system_bus ? activity.session_path : "(not watched)",
+               activity_is_active() ? "" : " (inactive)");
+    }
+}
+
+static void activity_cleanup(void) {
+    activity.system_bus = sd_bus_flush_close_unref(activity.system_bus);
+}
+
+// Event-triggered capture.
+//
+// KWin has no D-Bus signal for focus changes, so a small KWin script is
+// loaded that calls back into our unique bus name on windowActivated and
+// currentDesktopChanged. The VirtualDesktopManager currentChanged signal
+// is matched as well, so desktop switches still trigger when scripting is
+// unavailable. Events are debounced: the capture happens once no further
+// event arrived for config.debounce_ms.
+static struct {
+    char script_path[4096];
+    char plugin_name[64];
+    int script_loaded;
+    uint64_t due;           // 0 = no capture pending
+    const char *reason;
+} trigger;
+
+static void trigger_event(const char *reason) {
+    trigger.due = now_usec() + (uint64_t)config.debounce_ms * 1000;
+    trigger.reason = reason;
+}
+
+static int on_trigger_call(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)userdata;
+    (void)ret_error;
+    const char *what = NULL;
+    
+    if (!sd_bus_message_is_method_call(m, TRIGGER_INTERFACE, "Event")) {
+        return 0;
+    }
+    if (sd_bus_message_read(m, "s", &what) < 0 || !what) {
+        what = "event";
+    }
+    trigger_event(strcmp(what, "desktop") == 0 ? "desktop" : "window");
+    return sd_bus_reply_method_return(m, "");
+}
+
+static int on_desktop_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)m;
+    (void)userdata;
+    (void)ret_error;
+    trigger_event("desktop");
+    return 0;
+}
+
+static int trigger_load_script(sd_bus *bus) {
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *unique = NULL;
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int r = 0;
+    
+    r = sd_bus_get_unique_name(bus, &unique);
+    if (r < 0) {
+        return r;
+    }
+    
+    snprintf(trigger.plugin_name, sizeof(trigger.plugin_name), "fastshot-trigger-%d", (int)getpid());
+    char path[sizeof(trigger.script_path)];
+    snprintf(path, sizeof(path), "%s/%s.js", runtime ? runtime : "/tmp", trigger.plugin_name);
+    
+    // The /tmp fallback is shared with other users: never follow or reuse
+    // a file that is already there
+    int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        r = -errno;
+        close(fd);
+        unlink(path);
+        return r;
+    }
+    // Only remember paths we created, cleanup unlinks it
+    memcpy(trigger.script_path, path, sizeof(path));
+    fprintf(fp,
+        "function notify(what) {\n"
+        "    callDBus(\"%s\", \"%s\", \"%s\", \"Event\", what);\n"
+        "}\n"
+        "workspace.windowActivated.connect(function () { notify(\"window\"); });\n"
+        "workspace.currentDesktopChanged.connect(function () { notify(\"desktop\"); });\n",
+        unique, TRIGGER_OBJECT_PATH, TRIGGER_INTERFACE);
+    if (fclose(fp) != 0) {
+        return -errno;
+    }
+    
+    r = sd_bus_call_method(bus,
+        "org.kde.KWin", "/Scripting", "org.kde.kwin.Scripting", "loadScript",
+        &err, &reply, "ss", trigger.script_path, trigger.plugin_name);
+    if (r >= 0) {
+        sd_bus_message_unref(reply);
+        reply = NULL;
+        trigger.script_loaded = 1;
+        r = sd_bus_call_method(bus,
+            "org.kde.KWin", "/Scripting", "org.kde.kwin.Scripting", "start",
+            &err, &reply, "");
+    }
+    
+    if (r < 0 && config.verbose) {
+        fprintf(stderr, "KWin script error: %s: %s\n",
+                err.name ? err.name : "unknown",
+                err.message ? err.message : "no message");
+    }
+    
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&err);
+    return r;
+}
+
+static void trigger_init(sd_bus *bus) {
+    int r = sd_bus_add_object(bus, NULL, TRIGGER_OBJECT_PATH, on_trigger_call, NULL);
+    if (r >= 0) {
+        r = trigger_load_script(bus);
+    }
+    if (r < 0) {
+        fprintf(stderr, "Warning: window focus triggers unavailable: %s\n", strerror(-r));
+    }
+    
+    r = sd_bus_match_signal(bus, NULL, "org.kde.KWin", "/VirtualDesktopManager",
+        "org.kde.KWin.VirtualDesktopManager", "currentChanged",
+        on_desktop_changed, NULL);
+    if (r < 0) {
+        fprintf(stderr, "Warning: virtual desktop triggers unavailable: %s\n", strerror(-r));
+    }
+}
+
+static void trigger_cleanup(sd_bus *bus) {
+    if (trigger.script_loaded) {
+        sd_bus_error err = SD_BUS_ERROR_NULL;
+        sd_bus_call_method(bus,
+            "org.kde.KWin", "/Scripting", "org.kde.kwin.Scripting", "unloadScript",
+            &err, NULL, "s", trigger.plugin_name);
+        sd_bus_error_free(&err);
+        trigger.script_loaded = 0;
+    }
+    if (trigger.script_path[0]) {
+        unlink(trigger.script_path);
+        trigger.script_path[0] = '\0';
+    }
+}
+
+static int process_bus(sd_bus *bus) {
+    if (!bus) return 0;
+    int r;
+    while ((r = sd_bus_process(bus, NULL)) > 0) {
+    }
+    return r;
+}
+
+static int add_bus_pollfd(sd_bus *bus, struct pollfd *pfd, uint64_t *deadline) {
+    if (!bus) return 0;
+    
+    uint64_t until = UINT64_MAX;
+    pfd->fd = sd_bus_get_fd(bus);
+    pfd->events = sd_bus_get_events(bus);
+    pfd->revents = 0;
+    if (sd_bus_get_timeout(bus, &until) >= 0 && until < *deadline) {
+        *deadline = until;
+    }
+    return pfd->fd >= 0;
+}
+
+// Earliest time (now_usec) the next capture may happen, set after each save
+static uint64_t capture_not_before;
+
+// Sleep until the next capture is due while dispatching bus signals.
+// When the session is locked, idle or blanked there is no deadline at all;
+// the first capture after it becomes active again happens immediately.
+// A debounced trigger event ends the wait early; returns 1 in that case.
+static int wait_for_next_capture(sd_bus *bus, int seconds) {
+    uint64_t due = now_usec() + (uint64_t)seconds * 1000000;
+    int was_active = activity_is_active();
+    sd_bus *session = activity.session_lost ? NULL : bus;
+    
+    while (running) {
+        // A broken connection stays readable forever, so drop it from the
+        // poll set and forget the state it was feeding us
+        if (process_bus(session) < 0) {
+            fprintf(stderr, "Lost session bus connection, ignoring screensaver and triggers\n");
+            activity.session_lost = 1;
+            activity.screensaver = 0;
+            trigger.due = 0;
+            session = NULL;
+        }
+        if (process_bus(activity.system_bus) < 0) {
+            fprintf(stderr, "Lost system bus connection, ignoring idle and lock state\n");
+            activity.system_bus = sd_bus_flush_close_unref(activity.system_bus);
+            activity.idle = 0;
+            activity.locked = 0;
+        }
+        
+        int active = activity_is_active();
+        if (active != was_active) {
+            if (config.verbose) {
+                printf(active ? "Session active, resuming captures\n"
+                              : "Session locked or idle, pausing captures\n");
+                fflush(stdout);
+            }
+            was_active = active;
+            if (active) due = 0; // Capture right away
+        }
+        
+        uint64_t now = now_usec();
+        if (!active) {
+            trigger.due = 0; // Nothing to see while inactive
+        }
+        // Filenames have one-second resolution, never save twice in a second
+        if (due < capture_not_before) {
+            due = capture_not_before;
+        }
+        if (trigger.due && trigger.due < capture_not_before) {
+            trigger.due = capture_not_before;
+        }
+        if (active && trigger.due && now >= trigger.due) {
+            if (config.verbose) {
+                printf("Triggered by %s change\n", trigger.reason);
+                fflush(stdout);
+            }
+            trigger.due = 0;
+            return 1;
+        }
+        if (active && now >= due) return 0;
+        
+        struct pollfd fds[2];
+        uint64_t deadline = active ? due : UINT64_MAX;
+        if (active && trigger.due && trigger.due < deadline) {
+            deadline = trigger.due;
+        }
+        int nfds = 0;
+        nfds += add_bus_pollfd(session, &fds[nfds], &deadline);
+        nfds += add_bus_pollfd(activity.system_bus, &fds[nfds], &deadline);
+        
+        int timeout_ms = -1;
+        if (deadline != UINT64_MAX) {
+            uint64_t wait_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+            timeout_ms = wait_ms > INT_MAX ? INT_MAX : (int)wait_ms; // Loop re-checks after
+        }
+        poll(fds, nfds, timeout_ms);
+    }
+    
+    return 0;
+}
+
+static void log_capture(int fd, const timeline_record_t *entry) {
+    if (fd < 0) {
+        return;
+    }
+    int r = timeline_append(fd, entry);
+    if (r < 0) {
+        fprintf(stderr, "Failed to update %s: %s\n", TIMELINE_FILENAME, strerror(-r));
+    }
+}
+
+static int run_loop_mode(sd_bus *bus) {
+    screenshot_t current = {
+        .data = NULL,
+        .width = 0,
+        .height = 0,
+        .stride = 0,
+        .size = 0
+    };
+    screenshot_t last_saved = {
+        .data = NULL,
+        .width = 0,
+        .height = 0,
+        .stride = 0,
+        .size = 0
+    };
+    int first_shot = 1;
+    int triggered = 0;
+    int timeline_fd = -1;
+    
+    int threads = image_compare_init(config.threads);
+    if (threads < 0) {
+        fprintf(stderr, "Failed to start comparison threads: %s\n", strerror(-threads));
+    }
+    
+    if (config.verbose) {
+        printf("Starting screenshot loop:\n");
+        printf("  Directory: %s\n", config.directory);
+        printf("  Interval: %d seconds\n", config.interval);
+        printf("  Threshold: %.2f\n", config.threshold);
+        printf("  Compare threads: %d\n", image_compare_threads());
+        printf("  Deferred encoding: %s\n", config.defer ? "yes" : "no");
+    }
+    
+    // Before anything that registers with the bus, so failing here leaves
+    // nothing behind
+    if (config.defer && spool_start() < 0) {
+        image_compare_shutdown();
+        return 1;
+    }
+    
+    if (config.idle_pause) {
+        activity_init(bus);
+    }
+    
+    if (config.trigger) {
+        if (config.verbose) {
+            printf("  Trigger: window/desktop changes, %d ms debounce, %d s fallback\n",
+                   config.debounce_ms, config.interval);
+        }
+        trigger_init(bus);
+    }
+    
+    if (config.timeline) {
+        timeline_fd = timeline_open_append(config.directory);
+        if (timeline_fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", TIMELINE_FILENAME, strerror(-timeline_fd));
+        }
+    }
+    
+    // Wait for compositor to be ready
+    int compositor_wait_count = 0;
     while (running && !check_compositor_ready(bus)) {
         if (compositor_wait_count == 0) {
             if (config.verbose) {
                 printf("Waiting for compositor to be ready...\n");
             }
         }
-        sleep(5);
-        compositor_wait_count++;
-        if (compositor_wait_count > 12) { // Give up after 60 seconds
-            fprintf(stderr, "Warning: Compositor check timed out, proceeding anyway\n");
+        sleep(5);
+        compositor_wait_count++;
+        if (compositor_wait_count > 12) { // Give up after 60 seconds
+            fprintf(stderr, "Warning: Compositor check timed out, proceeding anyway\n");
+            break;
+        }
+    }
+    
+    // Hold the first capture back while the session is inactive
+    wait_for_next_capture(bus, 0);
+    
+    while (running) {
+        timeline_record_t entry = {
+            .similarity = -1.0f,
+            .flags = triggered ? TIMELINE_TRIGGERED : 0,
+        };
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        entry.timestamp_us = (int64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000;
+        
+        // Capture screenshot
+        uint64_t capture_start = now_usec();
+        int r = capture_screenshot(bus, &current);
+        entry.capture_us = (uint32_t)(now_usec() - capture_start);
+        if (r < 0) {
+            fprintf(stderr, "Failed to capture screenshot: %s\n", strerror(-r));
+            entry.flags |= TIMELINE_FAILED;
+            log_capture(timeline_fd, &entry);
+            
+            // If it's a NoOutput error, wait longer before retrying
+            if (r == -EIO || r == -ENOENT) {
+                if (config.verbose) {
+                    fprintf(stderr, "No screen output available, waiting...\n");
+                }
+                triggered = wait_for_next_capture(bus, 30); // Wait 30 seconds for screen to become available
+            } else {
+                triggered = wait_for_next_capture(bus, config.interval);
+            }
+            continue;
+        }
+        
+        int should_save = first_shot;
+        
+        if (first_shot || last_saved.data == NULL) {
+            entry.flags |= TIMELINE_FIRST;
+        } else {
+            // Compare with last saved screenshot
+            float tile_mse[TIMELINE_TILES];
+            float similarity = compare_screenshots(&current, &last_saved,
+                                                   timeline_fd >= 0 ? tile_mse : NULL);
+            entry.similarity = similarity;
+            if (timeline_fd >= 0) {
+                timeline_set_dirty(&entry, tile_mse);
+            }
+            if (current.width != last_saved.width || current.height != last_saved.height) {
+                entry.flags |= TIMELINE_RESIZED;
+            }
+            
+            if (config.verbose) {
+                printf("Similarity to last saved: %.4f\n", similarity);
+                fflush(stdout);
+            }
+            
+            if (similarity < config.threshold) {
+                should_save = 1;
+            }
+        }
+        
+        if (should_save) {
+            // Generate filename
+            time_t t = time(NULL);
+            struct tm tm = {0};
+            localtime_r(&t, &tm);
+            char filename[4096];
+            snprintf(filename, sizeof(filename), "%s/%04d.%02d.%02d-%02d.%02d.%02d.png",
+                     config.directory,
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec);
+            
+            // Save asynchronously
+            save_screenshot_async(&current, filename, t);
+            capture_not_before = now_usec() + 1000000;
+            entry.flags |= TIMELINE_SAVED;
+            snprintf(entry.filename, sizeof(entry.filename), "%s",
+                     filename + strlen(config.directory) + 1);
+            
+            // Update last_saved to current screenshot
+            if (last_saved.data) {
+                munmap(last_saved.data, last_saved.size);
+            }
+            
+            // Transfer ownership to last_saved
+            last_saved.data = current.data;
+            last_saved.width = current.width;
+            last_saved.height = current.height;
+            last_saved.stride = current.stride;
+            last_saved.size = current.size;
+            
+            // Clear current to prepare for next capture
+            current.data = NULL;
+            current.width = 0;
+            current.height = 0;
+            current.stride = 0;
+            current.size = 0;
+            
+            first_shot = 0;
+        } else {
+            // Not saving, so free current screenshot
+            if (current.data) {
+                munmap(current.data, current.size);
+                current.data = NULL;
+                current.width = 0;
+                current.height = 0;
+                current.stride = 0;
+                current.size = 0;
+            }
+        }
+        
+        log_capture(timeline_fd, &entry);
+        triggered = wait_for_next_capture(bus, config.interval);
+    }
+    
+    // Cleanup
+    if (last_saved.data) munmap(last_saved.data, last_saved.size);
+    if (timeline_fd >= 0) close(timeline_fd);
+    image_compare_shutdown();
+    spool_stop();
+    activity_cleanup();
+    trigger_cleanup(bus);
+    
+    if (config.verbose) {
+        printf("Shutting down\n");
+    }
+    
+    return 0;
+}
+
+// Hand a sealed memfd holding the PNG to whoever listens on the socket.
+// The payload is the PNG size in bytes as decimal text plus a newline.
+static int send_memfd(const char *target, int memfd, size_t size) {
+    int sock = -1;
+    int owned = 0;
+    char *end = NULL;
+    long n = strtol(target, &end, 10);
+    
+    if (*target && *end == '\0' && n >= 0) {
+        sock = (int)n;
+    } else {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(target) >= sizeof(addr.sun_path)) {
+            return -ENAMETOOLONG;
+        }
+        strcpy(addr.sun_path, target);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            return -errno;
+        }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            int err = errno;
+            close(sock);
+            return -err;
+        }
+        owned = 1;
+    }
+    
+    char payload[32];
+    int len = snprintf(payload, sizeof(payload), "%zu\n", size);
+    struct iovec iov = { .iov_base = payload, .iov_len = (size_t)len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    
+    int r = 0;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        r = -errno;
+    }
+    if (owned) {
+        close(sock);
+    }
+    return r;
+}
+
+static int run_single_shot(sd_bus *bus) {
+    screenshot_t shot = {0};
+    char *path = NULL;
+    int fd = -1;
+    int r = 0;
+    
+    // Generate filename if not provided
+    if (config.sink == SINK_FILE) {
+        if (config.output_file && *config.output_file) {
+            path = strdup(config.output_file);
+        } else {
+            time_t t = time(NULL);
+            struct tm tm = {0};
+            localtime_r(&t, &tm);
+            char buf[32];
+            strftime(buf, sizeof buf, "%Y.%m.%d-%H.%M.%S.png", &tm);
+            path = strdup(buf);
+        }
+        
+        if (!path) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    
+    // Capture screenshot
+    r = capture_screenshot(bus, &shot);
+    if (r < 0) {
+        fprintf(stderr, "Failed to capture screenshot: %s\n", strerror(-r));
+        free(path);
+        return 1;
+    }
+    
+    // Open output sink
+    switch (config.sink) {
+        case SINK_FILE:
+            fd = open(path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0600);
+            if (fd < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+            }
+            break;
+        case SINK_FD:
+            fd = config.output_fd;
+            break;
+        case SINK_MEMFD:
+            fd = memfd_create("fastshot.png", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0) {
+                fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+            }
             break;
+    }
+    
+    if (fd < 0) {
+        munmap(shot.data, shot.size);
+        free(path);
+        return 1;
+    }
+    
+    // Write PNG
+    r = write_png_fd(fd, shot.data, shot.width, shot.height, shot.stride,
+                     PNG_FAST_LEVEL);
+    if (r < 0) {
+        fprintf(stderr, "Failed to write PNG: %s\n", strerror(-r));
+    } else if (config.sink == SINK_MEMFD) {
+        off_t size = lseek(fd, 0, SEEK_CUR);
+        lseek(fd, 0, SEEK_SET);
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+            r = -errno;
+            fprintf(stderr, "Failed to seal memfd: %s\n", strerror(-r));
+        } else {
+            r = send_memfd(config.memfd_socket, fd, (size_t)size);
+            if (r < 0) {
+                fprintf(stderr, "Failed to send memfd to %s: %s\n", config.memfd_socket, strerror(-r));
+            }
         }
     }
     
-    while (running) {
-        // Capture screenshot
-        int r = capture_screenshot(bus, &current);
+    if (config.sink != SINK_FD) {
+        close(fd);
+    }
+    
+    if (r < 0) {
+        munmap(shot.data, shot.size);
+        free(path);
+        return 1;
+    }
+    
+    // Keep stdout clean when it carries the image itself
+    if (config.sink == SINK_FILE) {
+        printf("Screenshot saved as %s (%ux%u)\n", path, shot.width, shot.height);
+        fflush(stdout);
+    } else if (config.verbose) {
+        fprintf(stderr, "Screenshot streamed (%ux%u)\n", shot.width, shot.height);
+    }
+    
+    munmap(shot.data, shot.size);
+    free(path);
+    return 0;
+}
+
+// Accepts the filename format (2025.07.30-14.32.15), ISO-like dates with
+// or without a time of day, or @<unix seconds>
+static int parse_time(const char *text, int64_t *out) {
+    static const char *formats[] = {
+        "%Y.%m.%d-%H.%M.%S",
+        "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%dT%H:%M:%S",
+        "%Y-%m-%d %H:%M",
+        "%Y-%m-%d",
+    };
+    
+    if (text[0] == '@') {
+        char *end = NULL;
+        long long v = strtoll(text + 1, &end, 10);
+        if (end == text + 1 || *end != '\0') return -1;
+        *out = v;
+        return 0;
+    }
+    
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        const char *end = strptime(text, formats[i], &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            *out = (int64_t)mktime(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void print_query_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s query [OPTIONS] [image.png]\n", prog);
+    fprintf(stderr, "Find saved frames similar to an image and/or within a time range,\n");
+    fprintf(stderr, "using the index written by loop mode (no image files are read).\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d, --directory DIR    Directory holding %s (default: ~/desktop-record)\n", FRAME_INDEX_FILENAME);
+    fprintf(stderr, "  -n, --count N          Number of matches to print (default: 10)\n");
+    fprintf(stderr, "  -m, --max-distance N   Maximum hash distance in bits, 0-64 (default: 12)\n");
+    fprintf(stderr, "  --from TIME            Only frames at or after TIME\n");
+    fprintf(stderr, "  --to TIME              Only frames at or before TIME\n");
+    fprintf(stderr, "  -v, --verbose          Report index size and query time\n");
+    fprintf(stderr, "  -h, --help             Show this help\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "TIME is YYYY.MM.DD-HH.MM.SS, YYYY-MM-DD[ HH:MM[:SS]] or @UNIX_SECONDS.\n");
+    fprintf(stderr, "Output: time, hash distance, signature distance, path (tab separated).\n");
+}
+
+static int run_query(const char *prog, int argc, char **argv) {
+    static struct option long_options[] = {
+        {"directory", required_argument, 0, 'd'},
+        {"count", required_argument, 0, 'n'},
+        {"max-distance", required_argument, 0, 'm'},
+        {"from", required_argument, 0, 'f'},
+        {"to", required_argument, 0, 'T'},
+        {"verbose", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    int count = 10;
+    int max_distance = 12;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int opt;
+    
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "d:n:m:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                config.directory = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count <= 0) {
+                    fprintf(stderr, "Invalid count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                max_distance = atoi(optarg);
+                if (max_distance < 0 || max_distance > 64) {
+                    fprintf(stderr, "Invalid distance: %s (must be 0-64)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+            case 'T':
+                if (parse_time(optarg, opt == 'f' ? &from : &to) < 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                config.verbose = 1;
+                break;
+            case 'h':
+                print_query_usage(prog);
+                return 0;
+            default:
+                print_query_usage(prog);
+                return 1;
+        }
+    }
+    
+    const char *image = optind < argc ? argv[optind] : NULL;
+    if (!config.directory && set_default_directory() < 0) {
+        return 1;
+    }
+    
+    uint64_t dhash = 0;
+    uint8_t signature[IMAGE_SIGNATURE_SIZE];
+    if (image) {
+        screenshot_t shot = {0};
+        int r = read_png_bgra(image, &shot);
         if (r < 0) {
-            fprintf(stderr, "Failed to capture screenshot: %s\n", strerror(-r));
+            fprintf(stderr, "Failed to read %s: %s\n", image, strerror(-r));
+            return 1;
+        }
+        dhash = compute_dhash_bgra(shot.data, shot.width, shot.height, shot.stride);
+        compute_signature_bgra(shot.data, shot.width, shot.height, shot.stride, signature);
+        free(shot.data);
+    }
+    
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", config.directory, FRAME_INDEX_FILENAME);
+    frame_index_t index;
+    int r = frame_index_open(path, &index);
+    if (r < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(-r));
+        return 1;
+    }
+    
+    frame_index_match_t *matches = malloc((size_t)count * sizeof(*matches));
+    if (!matches) {
+        frame_index_close(&index);
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
+    uint64_t start = now_usec();
+    int found = 0;
+    if (image) {
+        found = frame_index_query(&index, dhash, signature, max_distance, from, to,
+                                  matches, (size_t)count);
+    } else {
+        // Time range only: the earliest frames in the range. Writer threads
+        // append concurrently, so file order is only roughly time order
+        for (size_t i = 0; i < index.count; i++) {
+            int64_t ts = index.records[i].timestamp;
+            if (ts < from || ts > to) continue;
             
-            // If it's a NoOutput error, wait longer before retrying
-            if (r == -EIO || r == -ENOENT) {
-                if (config.verbose) {
-                    fprintf(stderr, "No screen output available, waiting...\n");
-                }
-                sleep(30); // Wait 30 seconds for screen to become available
+            int pos = found;
+            if (pos == count) {
+                if (ts >= index.records[matches[pos - 1].record].timestamp) continue;
+                pos--;
             } else {
-                sleep(config.interval);
+                found++;
+            }
+            while (pos > 0 && ts < index.records[matches[pos - 1].record].timestamp) {
+                matches[pos] = matches[pos - 1];
+                pos--;
+            }
+            matches[pos] = (frame_index_match_t){ .record = i };
+        }
+    }
+    uint64_t elapsed = now_usec() - start;
+    
+    if (found < 0) {
+        fprintf(stderr, "Query failed: %s\n", strerror(-found));
+        found = 0;
+    }
+    
+    for (int i = 0; i < found; i++) {
+        const frame_index_record_t *rec = &index.records[matches[i].record];
+        time_t t = (time_t)rec->timestamp;
+        struct tm tm = {0};
+        char when[32];
+        localtime_r(&t, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s\t%d\t%u\t%s/%.*s\n", when, matches[i].distance,
+               matches[i].signature_distance, config.directory,
+               (int)sizeof(rec->filename), rec->filename);
+    }
+    
+    if (config.verbose) {
+        fprintf(stderr, "%d match(es) among %zu indexed frames in %.2f ms\n",
+                found, index.count, elapsed / 1000.0);
+    }
+    
+    free(matches);
+    frame_index_close(&index);
+    return 0;
+}
+
+// Batch transcoding of existing archives.
+//
+// Source PNGs are processed in filename (= timestamp) order. A pool of
+// workers pulls jobs from one shared queue: encoding kept frames first,
+// otherwise decoding the next file, at most BATCH_WINDOW(threads) frames
+// ahead of the dedup cursor. The main thread compares each decoded frame
+// against the last kept one in order, exactly like loop mode, and appends
+// its decision (K = kept, D = dropped, E = undecodable) to
+// DST/.fastshot-batch. On restart that log is replayed:
+// decided files are skipped, kept files whose output is missing are
+// re-encoded, and the last kept frame is decoded again as the reference.
+#define BATCH_WINDOW(threads) ((threads) * 2)
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_DECODING,
+    SLOT_READY,
+    SLOT_ENCODING,  // Queued for or running an encode
+} batch_slot_state_t;
+
+typedef struct {
+    char name[256];
+    int64_t timestamp;
+    int decided;        // Decision replayed from the progress log
+    int encode;         // Replayed keep whose output is missing
+    int reference;      // Replayed keep that becomes the dedup reference
+} batch_item_t;
+
+typedef struct {
+    batch_slot_state_t state;
+    size_t item;
+    int error;
+    screenshot_t shot;  // malloc'ed by read_png_bgra
+} batch_slot_t;
+
+typedef struct {
+    const char *src;
+    const char *dst;
+    int level;
+    int index;
+    batch_item_t *items;
+    size_t count;
+    size_t todo;            // Items that still need a dedup decision
+    
+    batch_slot_t *slots;
+    size_t window;
+    size_t next_decode;     // Next item to hand to a decoder
+    size_t cursor;          // Next item the dedup pass will look at
+    size_t *encode_queue;   // Ring of slot numbers waiting to be encoded
+    size_t encode_head;
+    size_t encode_tail;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t encoded;
+    _Atomic uint64_t failed;
+} batch_t;
+
+static int64_t batch_timestamp(const char *dir, const char *name) {
+    char stem[256];
+    int64_t ts = 0;
+    
+    snprintf(stem, sizeof(stem), "%s", name);
+    char *dot = strrchr(stem, '.');
+    if (dot) *dot = '\0';
+    if (parse_time(stem, &ts) == 0) {
+        return ts;
+    }
+    
+    // Not one of our filenames: fall back to the modification time
+    char path[4096 + 256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 ? (int64_t)st.st_mtime : 0;
+}
+
+// Same order as the timestamps written to the index, names break ties
+static int batch_item_cmp(const void *a, const void *b) {
+    const batch_item_t *x = a, *y = b;
+    if (x->timestamp != y->timestamp) {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int batch_list(const char *dir, batch_item_t **items, size_t *count) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -errno;
+    }
+    
+    size_t n = 0, cap = 0;
+    batch_item_t *list = NULL;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len < 5 || len >= sizeof(list->name) ||
+            strcmp(ent->d_name + len - 4, ".png") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            batch_item_t *grown = realloc(list, cap * sizeof(*list));
+            if (!grown) {
+                free(list);
+                closedir(d);
+                return -ENOMEM;
             }
+            list = grown;
+        }
+        memset(&list[n], 0, sizeof(list[n]));
+        memcpy(list[n].name, ent->d_name, len + 1);
+        n++;
+    }
+    closedir(d);
+    
+    for (size_t i = 0; i < n; i++) {
+        list[i].timestamp = batch_timestamp(dir, list[i].name);
+    }
+    qsort(list, n, sizeof(*list), batch_item_cmp);
+    
+    *items = list;
+    *count = n;
+    return 0;
+}
+
+static int batch_output_exists(const batch_t *b, const char *name) {
+    char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", b->dst, name);
+    return access(path, F_OK) == 0;
+}
+
+// Replay the progress log against the sorted source list. Returns how many
+// leading items were already decided and rewrites the log to that prefix.
+static size_t batch_resume(batch_t *b) {
+    char path[4096];
+    char tmp[4096 + 8];
+    snprintf(path, sizeof(path), "%s/%s", b->dst, BATCH_PROGRESS_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    
+    FILE *in = fopen(path, "re");
+    if (!in) {
+        return 0;
+    }
+    FILE *out = fopen(tmp, "we");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    
+    size_t done = 0;
+    ssize_t last_kept = -1;
+    char line[512];
+    while (done < b->count && fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+        if (len < 3 || line[len - 1] != '\n' || line[1] != ' ') break; // Torn line
+        line[len - 1] = '\0';
+        if (strcmp(line + 2, b->items[done].name) != 0) break;
+        
+        batch_item_t *item = &b->items[done];
+        item->decided = 1;
+        if (line[0] == 'K') {
+            last_kept = (ssize_t)done;
+            item->encode = !batch_output_exists(b, item->name);
+        }
+        fprintf(out, "%s\n", line);
+        done++;
+    }
+    fclose(in);
+    fclose(out);
+    rename(tmp, path);
+    
+    if (last_kept >= 0) {
+        b->items[last_kept].reference = 1;
+    }
+    return done;
+}
+
+static void batch_encode(batch_t *b, batch_slot_t *slot) {
+    const batch_item_t *item = &b->items[slot->item];
+    char final[4096 + 256];
+    char part[4096 + 256 + 8];
+    snprintf(final, sizeof(final), "%s/%s", b->dst, item->name);
+    snprintf(part, sizeof(part), "%s.part", final);
+    
+    int r = 0;
+    int fd = open(part, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        r = -errno;
+    } else {
+        r = write_png_fd(fd, slot->shot.data, slot->shot.width, slot->shot.height,
+                         slot->shot.stride, b->level);
+        close(fd);
+        if (r == 0 && rename(part, final) < 0) {
+            r = -errno;
+        }
+        if (r < 0) {
+            unlink(part);
+        }
+    }
+    
+    if (r == 0 && b->index) {
+        frame_index_record_t record;
+        frame_index_fill(&record, slot->shot.data, slot->shot.width, slot->shot.height,
+                         slot->shot.stride, item->timestamp, item->name);
+        r = frame_index_append(b->dst, &record);
+    }
+    
+    if (r < 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", final, strerror(-r));
+        atomic_fetch_add(&b->failed, 1);
+    } else {
+        atomic_fetch_add(&b->encoded, 1);
+    }
+}
+
+static void batch_release(batch_slot_t *slot) {
+    free(slot->shot.data);
+    memset(&slot->shot, 0, sizeof(slot->shot));
+    slot->state = SLOT_FREE;
+}
+
+static void *batch_worker(void *arg) {
+    batch_t *b = (batch_t *)arg;
+    
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        if (b->encode_head != b->encode_tail) {
+            // Encodes first: they release slots and unblock decoding
+            batch_slot_t *slot = &b->slots[b->encode_queue[b->encode_head++ % b->window]];
+            pthread_mutex_unlock(&b->lock);
+            batch_encode(b, slot);
+            pthread_mutex_lock(&b->lock);
+            batch_release(slot);
+            pthread_cond_broadcast(&b->cond);
             continue;
         }
         
-        int should_save = first_shot;
-        
-        if (!first_shot && last_saved.data != NULL) {
-            // Compare with last saved screenshot
-            float similarity = compare_screenshots(&current, &last_saved);
-            
-            if (config.verbose) {
-                printf("Similarity to last saved: %.4f\n", similarity);
-                fflush(stdout);
-            }
-            
-            if (similarity < config.threshold) {
-                should_save = 1;
-            }
+        if (b->stopping) {
+            break;
         }
         
-        if (should_save) {
-            // Generate filename
-            time_t t = time(NULL);
-            struct tm tm = {0};
-            localtime_r(&t, &tm);
-            char filename[4096];
-            snprintf(filename, sizeof(filename), "%s/%04d.%02d.%02d-%02d.%02d.%02d.png",
-                     config.directory,
-                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                     tm.tm_hour, tm.tm_min, tm.tm_sec);
-            
-            // Save asynchronously
-            save_screenshot_async(&current, filename);
+        size_t i = b->next_decode;
+        batch_slot_t *slot = i < b->count ? &b->slots[i % b->window] : NULL;
+        if (slot && i < b->cursor + b->window && slot->state == SLOT_FREE) {
+            b->next_decode++;
+            slot->state = SLOT_DECODING;
+            slot->item = i;
+            pthread_mutex_unlock(&b->lock);
             
-            // Update last_saved to current screenshot
-            if (last_saved.data) {
-                munmap(last_saved.data, last_saved.size);
+            char path[4096 + 256];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", b->src, b->items[i].name);
+            slot->error = read_png_bgra(path, &slot->shot);
+            if (stat(path, &st) == 0) {
+                atomic_fetch_add(&b->bytes_read, (uint64_t)st.st_size);
             }
             
-            // Transfer ownership to last_saved
-            last_saved.data = current.data;
-            last_saved.width = current.width;
-            last_saved.height = current.height;
-            last_saved.stride = current.stride;
-            last_saved.size = current.size;
-            
-            // Clear current to prepare for next capture
-            current.data = NULL;
-            current.width = 0;
-            current.height = 0;
-            current.stride = 0;
-            current.size = 0;
-            
-            first_shot = 0;
-        } else {
-            // Not saving, so free current screenshot
-            if (current.data) {
-                munmap(current.data, current.size);
-                current.data = NULL;
-                current.width = 0;
-                current.height = 0;
-                current.stride = 0;
-                current.size = 0;
-            }
+            pthread_mutex_lock(&b->lock);
+            slot->state = SLOT_READY;
+            pthread_cond_broadcast(&b->cond);
+            continue;
         }
         
-        sleep(config.interval);
+        pthread_cond_wait(&b->cond, &b->lock);
     }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static void batch_report(const batch_t *b, size_t decided, size_t kept,
+                         uint64_t start, int final) {
+    double secs = (now_usec() - start) / 1e6;
+    if (secs <= 0) secs = 1e-6;
+    fprintf(stderr, "%s%zu/%zu frames, %zu kept, %llu encoded, %.1f frames/s, %.1f MB/s read%s",
+            final ? "" : "\r", decided, b->todo, kept,
+            (unsigned long long)atomic_load(&b->encoded),
+            decided / secs, atomic_load(&b->bytes_read) / secs / 1e6,
+            final ? "\n" : "");
+}
+
+static void print_batch_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s batch [OPTIONS] SRC_DIR DST_DIR\n", prog);
+    fprintf(stderr, "Re-deduplicate and re-encode an archive of screenshots in timestamp order.\n");
+    fprintf(stderr, "Interrupted runs resume where they stopped.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -j, --threads N        Decode/encode workers (default: 0 = all CPUs)\n");
+    fprintf(stderr, "  -t, --threshold FLOAT  Similarity threshold 0-1 (default: %.2f)\n", DEFAULT_THRESHOLD);
+    fprintf(stderr, "  -c, --compression N    PNG zlib level 0-9 (default: %d)\n", BATCH_DEFAULT_LEVEL);
+    fprintf(stderr, "  --index                Append kept frames to DST_DIR/%s\n", FRAME_INDEX_FILENAME);
+    fprintf(stderr, "  -v, --verbose          Print every decision\n");
+    fprintf(stderr, "  -h, --help             Show this help\n");
+}
+
+static int run_batch(const char *prog, int argc, char **argv) {
+    static struct option long_options[] = {
+        {"threads", required_argument, 0, 'j'},
+        {"threshold", required_argument, 0, 't'},
+        {"compression", required_argument, 0, 'c'},
+        {"index", no_argument, 0, 'x'},
+        {"verbose", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
     
-    // Cleanup
-    if (last_saved.data) munmap(last_saved.data, last_saved.size);
+    batch_t b = {
+        .level = BATCH_DEFAULT_LEVEL,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int threads = 0;
+    int opt;
     
-    if (config.verbose) {
-        printf("Shutting down\n");
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "j:t:c:vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                if (parse_thread_count(optarg, &threads) < 0) {
+                    return 1;
+                }
+                break;
+            case 't':
+                config.threshold = atof(optarg);
+                if (config.threshold < 0.0 || config.threshold > 1.0) {
+                    fprintf(stderr, "Invalid threshold: %s (must be 0-1)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                b.level = atoi(optarg);
+                if (b.level < 0 || b.level > 9) {
+                    fprintf(stderr, "Invalid compression level: %s (must be 0-9)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x':
+                b.index = 1;
+                break;
+            case 'v':
+                config.verbose = 1;
+                break;
+            case 'h':
+                print_batch_usage(prog);
+                return 0;
+            default:
+                print_batch_usage(prog);
+                return 1;
+        }
     }
     
-    return 0;
-}
-
-static int run_single_shot(sd_bus *bus) {
-    screenshot_t shot = {0};
-    char *path = NULL;
-    int fd = -1;
-    int r = 0;
+    if (argc - optind != 2) {
+        print_batch_usage(prog);
+        return 1;
+    }
+    b.src = argv[optind];
+    b.dst = argv[optind + 1];
     
-    // Generate filename if not provided
-    if (config.output_file && *config.output_file) {
-        path = strdup(config.output_file);
-    } else {
-        time_t t = time(NULL);
-        struct tm tm = {0};
-        localtime_r(&t, &tm);
-        char buf[32];
-        strftime(buf, sizeof buf, "%Y.%m.%d-%H.%M.%S.png", &tm);
-        path = strdup(buf);
+    if (threads == 0) {
+        cpu_set_t allowed;
+        threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
     }
+    if (threads < 1) threads = 1;
     
-    if (!path) {
-        fprintf(stderr, "Out of memory\n");
+    if (ensure_directory(b.dst) < 0) {
         return 1;
     }
     
-    // Capture screenshot
-    r = capture_screenshot(bus, &shot);
+    // Half-written outputs from an interrupted run
+    DIR *d = opendir(b.dst);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            size_t len = strlen(ent->d_name);
+            if (len > 5 && strcmp(ent->d_name + len - 5, ".part") == 0) {
+                unlinkat(dirfd(d), ent->d_name, 0);
+            }
+        }
+        closedir(d);
+    }
+    
+    batch_item_t *all = NULL;
+    size_t total = 0;
+    int r = batch_list(b.src, &all, &total);
     if (r < 0) {
-        fprintf(stderr, "Failed to capture screenshot: %s\n", strerror(-r));
-        free(path);
+        fprintf(stderr, "Failed to read %s: %s\n", b.src, strerror(-r));
         return 1;
     }
+    b.items = all;
+    b.count = total;
     
-    // Open output file
-    fd = open(path, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0600);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
-        munmap(shot.data, shot.size);
-        free(path);
-        return 1;
+    // Drop replayed items that need no work; keep the rest in order
+    size_t resumed = batch_resume(&b);
+    size_t skipped = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (all[i].decided && !all[i].encode && !all[i].reference) {
+            skipped++;
+            continue;
+        }
+        b.todo += !all[i].decided;
+        all[n++] = all[i];
     }
+    b.count = n;
     
-    // Write PNG
-    FILE *fp = fdopen(fd, "wb");
-    if (!fp) {
-        fprintf(stderr, "fdopen failed\n");
-        close(fd);
-        munmap(shot.data, shot.size);
-        free(path);
-        return 1;
+    if (resumed > 0) {
+        fprintf(stderr, "Resuming: %zu of %zu frames already processed\n", resumed, total);
     }
     
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        munmap(shot.data, shot.size);
-        free(path);
+    char log_path[4096];
+    snprintf(log_path, sizeof(log_path), "%s/%s", b.dst, BATCH_PROGRESS_FILE);
+    FILE *progress = fopen(log_path, "ae");
+    if (!progress) {
+        fprintf(stderr, "Failed to open %s: %s\n", log_path, strerror(errno));
+        free(all);
         return 1;
     }
     
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        munmap(shot.data, shot.size);
-        free(path);
+    b.window = BATCH_WINDOW((size_t)threads);
+    b.slots = calloc(b.window, sizeof(*b.slots));
+    b.encode_queue = calloc(b.window, sizeof(*b.encode_queue));
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    if (!b.slots || !b.encode_queue || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(progress);
+        free(b.slots);
+        free(b.encode_queue);
+        free(workers);
+        free(all);
         return 1;
     }
     
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        munmap(shot.data, shot.size);
-        free(path);
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &b) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Failed to create worker threads\n");
+        fclose(progress);
+        free(b.slots);
+        free(b.encode_queue);
+        free(workers);
+        free(all);
         return 1;
     }
     
-    png_init_io(png, fp);
-    png_set_compression_level(png, 1);
-    png_set_filter(png, 0, PNG_FILTER_NONE);
-    
-    png_set_IHDR(png, info, shot.width, shot.height, 8, PNG_COLOR_TYPE_RGBA,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
+    if (config.verbose) {
+        fprintf(stderr, "Batch: %s -> %s, %zu frames to process, %d workers, zlib level %d\n",
+                b.src, b.dst, b.todo, started, b.level);
+    }
     
-    png_write_info(png, info);
-    png_set_bgr(png);
+    screenshot_t reference = {0};
+    size_t decided = 0, kept = 0;
+    uint64_t start = now_usec();
+    uint64_t last_report = start;
     
-    // Write rows
-    for (uint32_t y = 0; y < shot.height; y++) {
-        png_write_row(png, shot.data + y * shot.stride);
+    for (size_t i = 0; i < b.count && running; i++) {
+        batch_slot_t *slot = &b.slots[i % b.window];
+        batch_item_t *item = &b.items[i];
+        
+        pthread_mutex_lock(&b.lock);
+        while (!(slot->state == SLOT_READY && slot->item == i)) {
+            pthread_cond_wait(&b.cond, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+        
+        int keep = 0;
+        if (slot->error < 0) {
+            fprintf(stderr, "Failed to decode %s: %s\n", item->name, strerror(-slot->error));
+            atomic_fetch_add(&b.failed, 1);
+            if (!item->decided) {
+                fprintf(progress, "E %s\n", item->name);
+                fflush(progress);
+            }
+        } else if (item->decided) {
+            keep = item->encode;
+        } else {
+            keep = reference.data == NULL;
+            if (!keep) {
+                float similarity = compare_screenshots(&slot->shot, &reference, NULL);
+                keep = similarity < config.threshold;
+                if (config.verbose) {
+                    fprintf(stderr, "%s: similarity %.4f, %s\n", item->name, similarity,
+                            keep ? "kept" : "dropped");
+                }
+            }
+            fprintf(progress, "%c %s\n", keep ? 'K' : 'D', item->name);
+            fflush(progress);
+        }
+        
+        // The last kept frame stays as the reference for the next ones
+        if (slot->error == 0 && (item->reference || (!item->decided && keep))) {
+            void *copy = realloc(reference.data, slot->shot.size);
+            if (copy) {
+                memcpy(copy, slot->shot.data, slot->shot.size);
+                reference = slot->shot;
+                reference.data = copy;
+            }
+        }
+        
+        pthread_mutex_lock(&b.lock);
+        if (keep) {
+            slot->state = SLOT_ENCODING;
+            b.encode_queue[b.encode_tail++ % b.window] = i % b.window;
+        } else {
+            batch_release(slot);
+        }
+        b.cursor = i + 1;
+        pthread_cond_broadcast(&b.cond);
+        pthread_mutex_unlock(&b.lock);
+        
+        if (!item->decided) {
+            decided++;
+            kept += keep;
+        }
+        
+        uint64_t now = now_usec();
+        if (now - last_report >= BATCH_REPORT_INTERVAL * 1000000ULL) {
+            batch_report(&b, decided, kept, start, 0);
+            last_report = now;
+        }
     }
     
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    // Let queued encodes finish, then stop the pool
+    pthread_mutex_lock(&b.lock);
+    b.stopping = 1;
+    pthread_cond_broadcast(&b.cond);
+    pthread_mutex_unlock(&b.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
     
-    printf("Screenshot saved as %s (%ux%u)\n", path, shot.width, shot.height);
-    fflush(stdout);
+    fclose(progress);
+    batch_report(&b, decided, kept, start, 1);
+    if (skipped > 0) {
+        fprintf(stderr, "%zu frames were already done in a previous run\n", skipped);
+    }
+    if (!running) {
+        fprintf(stderr, "Interrupted; run the same command again to resume\n");
+    }
     
-    munmap(shot.data, shot.size);
-    free(path);
-    return 0;
+    int failed = atomic_load(&b.failed) > 0;
+    for (size_t i = 0; i < b.window; i++) {
+        free(b.slots[i].shot.data);
+    }
+    free(reference.data);
+    free(b.slots);
+    free(b.encode_queue);
+    free(workers);
+    free(all);
+    return failed || !running;
 }
 
-int main(int argc, char **argv) {
-    if (parse_args(argc, argv) < 0) {
+static void print_timeline_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s timeline [OPTIONS]\n", prog);
+    fprintf(stderr, "Read the capture timeline written by loop mode.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d, --directory DIR    Directory holding %s (default: ~/desktop-record)\n", TIMELINE_FILENAME);
+    fprintf(stderr, "  --from TIME            Only captures at or after TIME\n");
+    fprintf(stderr, "  --to TIME              Only captures at or before TIME\n");
+    fprintf(stderr, "  --heatmap              Print how often each screen tile changed between saved frames\n");
+    fprintf(stderr, "  --thresholds           Print how many captures each -t value would have saved\n");
+    fprintf(stderr, "  -h, --help             Show this help\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "TIME is YYYY.MM.DD-HH.MM.SS, YYYY-MM-DD[ HH:MM[:SS]] or @UNIX_SECONDS.\n");
+    fprintf(stderr, "Default output: time, capture ms, similarity, flags (S=saved F=failed\n");
+    fprintf(stderr, "T=triggered R=resized 1=first), dirty tiles, file (tab separated).\n");
+}
+
+static int run_timeline(const char *prog, int argc, char **argv) {
+    static struct option long_options[] = {
+        {"directory", required_argument, 0, 'd'},
+        {"from", required_argument, 0, 'f'},
+        {"to", required_argument, 0, 'T'},
+        {"heatmap", no_argument, 0, 'H'},
+        {"thresholds", no_argument, 0, 'R'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    int heatmap = 0;
+    int thresholds = 0;
+    int opt;
+    
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "d:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                config.directory = optarg;
+                break;
+            case 'f':
+            case 'T':
+                if (parse_time(optarg, opt == 'f' ? &from : &to) < 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                heatmap = 1;
+                break;
+            case 'R':
+                thresholds = 1;
+                break;
+            case 'h':
+                print_timeline_usage(prog);
+                return 0;
+            default:
+                print_timeline_usage(prog);
+                return 1;
+        }
+    }
+    
+    if (!config.directory && set_default_directory() < 0) {
+        return 1;
+    }
+    
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", config.directory, TIMELINE_FILENAME);
+    timeline_t timeline;
+    int r = timeline_open(path, &timeline);
+    if (r < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(-r));
         return 1;
     }
     
+    static const float levels[] = { 0.90f, 0.95f, 0.97f, 0.98f, 0.99f, 0.995f, 0.999f };
+    size_t below[sizeof(levels) / sizeof(levels[0])] = {0};
+    uint64_t tile_changes[TIMELINE_TILES] = {0};
+    size_t captures = 0, compared = 0, saved = 0, failed = 0, saved_compared = 0;
+    uint64_t capture_us = 0;
+    
+    for (size_t i = 0; i < timeline.count; i++) {
+        const timeline_record_t *rec = &timeline.records[i];
+        int64_t secs = rec->timestamp_us / 1000000;
+        if (secs < from || secs > to) continue;
+        
+        captures++;
+        capture_us += rec->capture_us;
+        saved += (rec->flags & TIMELINE_SAVED) != 0;
+        failed += (rec->flags & TIMELINE_FAILED) != 0;
+        
+        // Dirty bits are relative to the last saved frame, so only a saved
+        // frame's bits describe one change; skipped captures would count the
+        // same change again
+        int counted = (rec->flags & TIMELINE_SAVED) && !(rec->flags & TIMELINE_FIRST);
+        saved_compared += counted;
+        int dirty = 0;
+        for (int t = 0; t < TIMELINE_TILES; t++) {
+            if (timeline_is_dirty(rec, t)) {
+                tile_changes[t] += counted;
+                dirty++;
+            }
+        }
+        
+        if (rec->similarity >= 0) {
+            compared++;
+            for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+                below[l] += rec->similarity < levels[l];
+            }
+        }
+        
+        if (heatmap || thresholds) continue;
+        
+        time_t t = (time_t)secs;
+        struct tm tm = {0};
+        char when[32];
+        char flags[8];
+        int nflags = 0;
+        localtime_r(&t, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        if (rec->flags & TIMELINE_SAVED) flags[nflags++] = 'S';
+        if (rec->flags & TIMELINE_FAILED) flags[nflags++] = 'F';
+        if (rec->flags & TIMELINE_TRIGGERED) flags[nflags++] = 'T';
+        if (rec->flags & TIMELINE_RESIZED) flags[nflags++] = 'R';
+        if (rec->flags & TIMELINE_FIRST) flags[nflags++] = '1';
+        if (nflags == 0) flags[nflags++] = '-';
+        flags[nflags] = '\0';
+        
+        printf("%s.%03d\t%.1f\t%.4f\t%s\t%d\t%.*s\n", when,
+               (int)(rec->timestamp_us / 1000 % 1000), rec->capture_us / 1000.0,
+               rec->similarity, flags, dirty,
+               (int)sizeof(rec->filename), rec->filename);
+    }
+    
+    if (heatmap) {
+        // Percentage of saved frames in which each tile differed from the
+        // saved frame before it
+        printf("Tile change frequency (%%) over %zu saved frames:\n", saved_compared);
+        for (int y = 0; y < TIMELINE_TILES_Y; y++) {
+            for (int x = 0; x < TIMELINE_TILES_X; x++) {
+                uint64_t n = tile_changes[y * TIMELINE_TILES_X + x];
+                printf("%4d", saved_compared ? (int)(n * 100 / saved_compared) : 0);
+            }
+            printf("\n");
+        }
+    }
+    
+    if (thresholds) {
+        // Approximate: similarity was measured against the frame saved under
+        // the threshold in effect at capture time
+        printf("%zu captures, %zu compared, %zu saved, %zu failed, %.1f ms mean capture\n",
+               captures, compared, saved, failed,
+               captures ? capture_us / 1000.0 / captures : 0.0);
+        printf("threshold\twould save\n");
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            printf("%.3f\t%zu\n", levels[l], below[l]);
+        }
+    }
+    
+    timeline_close(&timeline);
+    return 0;
+}
+
+int main(int argc, char **argv) {
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    // A consumer closing its end of the pipe should fail the write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return run_query(argv[0], argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        return run_batch(argv[0], argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "timeline") == 0) {
+        return run_timeline(argv[0], argc - 1, argv + 1);
+    }
+    
+    if (parse_args(argc, argv) < 0) {
+        return 1;
+    }
+    
     // Ensure output directory exists for loop mode
     if (config.loop_mode && ensure_directory(config.directory) < 0) {
         return 1;
@@ -0,0 +1,116 @@
+#include "frame-index.h"
+#include "record-file.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void frame_index_fill(frame_index_record_t *record, const uint8_t *img,
+                      uint32_t width, uint32_t height, uint32_t stride,
+                      int64_t timestamp, const char *filename) {
+    memset(record, 0, sizeof(*record));
+    record->timestamp = timestamp;
+    record->width = width;
+    record->height = height;
+    record->dhash = compute_dhash_bgra(img, width, height, stride);
+    compute_signature_bgra(img, width, height, stride, record->signature);
+    
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    snprintf(record->filename, sizeof(record->filename), "%s", base);
+}
+
+int frame_index_append(const char *directory, const frame_index_record_t *record) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, FRAME_INDEX_FILENAME);
+    
+    // Writer threads append concurrently, keep header setup and the
+    // torn-tail trim from racing each other
+    pthread_mutex_lock(&append_lock);
+    
+    int fd = record_file_open_append(path, FRAME_INDEX_MAGIC, FRAME_INDEX_VERSION,
+                                     sizeof(frame_index_record_t));
+    int r = fd;
+    if (fd >= 0) {
+        r = write_all(fd, record, sizeof(*record));
+        close(fd);
+    }
+    
+    pthread_mutex_unlock(&append_lock);
+    return r;
+}
+
+int frame_index_open(const char *path, frame_index_t *index) {
+    memset(index, 0, sizeof(*index));
+    
+    record_file_t file;
+    int r = record_file_open(path, FRAME_INDEX_MAGIC, FRAME_INDEX_VERSION,
+                             sizeof(frame_index_record_t), &file);
+    if (r < 0) {
+        return r;
+    }
+    
+    index->records = file.records;
+    index->count = file.count;
+    index->map = file.map;
+    index->map_size = file.map_size;
+    return 0;
+}
+
+void frame_index_close(frame_index_t *index) {
+    record_file_t file = { .map = index->map, .map_size = index->map_size };
+    record_file_close(&file);
+    memset(index, 0, sizeof(*index));
+}
+
+static int match_before(const frame_index_match_t *a, const frame_index_match_t *b) {
+    if (a->distance != b->distance) return a->distance < b->distance;
+    if (a->signature_distance != b->signature_distance) {
+        return a->signature_distance < b->signature_distance;
+    }
+    return a->record < b->record;
+}
+
+int frame_index_query(const frame_index_t *index, uint64_t dhash,
+                      const uint8_t *signature, int max_distance,
+                      int64_t from, int64_t to,
+                      frame_index_match_t *matches, size_t max_matches) {
+    if (max_matches == 0) {
+        return 0;
+    }
+    
+    // One pass over the records: timestamp and dhash share the first cache
+    // line of each record, so rejects cost a load and a popcount
+    size_t found = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        const frame_index_record_t *rec = &index->records[i];
+        if (rec->timestamp < from || rec->timestamp > to) continue;
+        
+        int distance = hash_distance(rec->dhash, dhash);
+        if (distance > max_distance) continue;
+        
+        frame_index_match_t m = {
+            .record = i,
+            .distance = distance,
+            .signature_distance = signature ? signature_distance(rec->signature, signature) : 0,
+        };
+        
+        // Insertion into the sorted top-N list
+        size_t pos = found;
+        if (pos == max_matches) {
+            if (!match_before(&m, &matches[pos - 1])) continue;
+            pos--;
+        } else {
+            found++;
+        }
+        while (pos > 0 && match_before(&m, &matches[pos - 1])) {
+            matches[pos] = matches[pos - 1];
+            pos--;
+        }
+        matches[pos] = m;
+    }
+    
+    return (int)found;
+}
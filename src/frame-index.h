@@ -0,0 +1,63 @@
+#ifndef FRAME_INDEX_H
+#define FRAME_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image-compare.h"
+
+// Append-only similarity index kept next to the saved frames.
+//
+// The file is a record file (see record-file.h) of frame_index_record_t,
+// so it can be mmap'ed and read as an array. Records are appended as each
+// write completes, which is only roughly capture order; readers must not
+// assume the timestamps are sorted.
+#define FRAME_INDEX_FILENAME "index.fsi"
+#define FRAME_INDEX_MAGIC "FSINDEX1"
+#define FRAME_INDEX_VERSION 2 // 2: filename widened to NAME_MAX
+
+typedef struct {
+    int64_t timestamp;          // Unix seconds the frame was captured
+    uint64_t dhash;             // compute_dhash_bgra()
+    uint32_t width;
+    uint32_t height;
+    uint8_t signature[IMAGE_SIGNATURE_SIZE]; // compute_signature_bgra()
+    char filename[256];         // Basename relative to the index directory
+} frame_index_record_t;
+
+typedef struct {
+    const frame_index_record_t *records;
+    size_t count;
+    void *map;
+    size_t map_size;
+} frame_index_t;
+
+typedef struct {
+    size_t record;              // Position in frame_index_t.records
+    int distance;               // Hamming distance of the dHash
+    uint32_t signature_distance;
+} frame_index_match_t;
+
+// Fill a record for a BGRA frame (hash, signature and basename of filename)
+void frame_index_fill(frame_index_record_t *record, const uint8_t *img,
+                      uint32_t width, uint32_t height, uint32_t stride,
+                      int64_t timestamp, const char *filename);
+
+// Append one record to <directory>/index.fsi, creating it if needed. An
+// index written with another record layout is renamed to index.fsi.old
+// and a new one is started. Thread-safe. Returns 0 or -errno.
+int frame_index_append(const char *directory, const frame_index_record_t *record);
+
+// Map an index file read-only. Returns 0 or -errno.
+int frame_index_open(const char *path, frame_index_t *index);
+void frame_index_close(frame_index_t *index);
+
+// Find the records within max_distance bits of dhash whose timestamps lie
+// in [from, to], nearest first (ties broken by signature distance; pass
+// signature = NULL to skip that). This is a linear scan, O(n) in the index
+// size. Returns the number of matches written.
+int frame_index_query(const frame_index_t *index, uint64_t dhash,
+                      const uint8_t *signature, int max_distance,
+                      int64_t from, int64_t to,
+                      frame_index_match_t *matches, size_t max_matches);
+
+#endif // FRAME_INDEX_H
@@ -1,11 +1,262 @@
+#define _GNU_SOURCE
 #include "image-compare.h"
 #include <libavutil/imgutils.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define BGRA_CHANNELS 4
+#define MAX_COMPARE_THREADS 64
 
-float calculate_mse_bgra(const uint8_t *img1, const uint8_t *img2, 
-                         uint32_t width, uint32_t height, 
-                         uint32_t stride1, uint32_t stride2) {
+// Per-thread partial sum, padded so workers never share a cache line
+typedef struct {
+    uint64_t sse;
+    char pad[64 - sizeof(uint64_t)];
+} partial_sum_t;
+
+typedef struct {
+    const uint8_t *img1;
+    const uint8_t *img2;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t rows_per_thread;
+    uint32_t tiles_x;           // 0 = no per-tile sums
+    uint32_t tiles_y;
+} mse_job_t;
+
+static struct {
+    pthread_t workers[MAX_COMPARE_THREADS];
+    int nthreads;               // Including the calling thread
+    int started;
+    int stop;
+    uint64_t generation;        // Bumped for every dispatched job
+    int pending;                // Workers still running the current job
+    mse_job_t job;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    pthread_mutex_t dispatch_lock; // Only one caller may own the pool at a time
+    _Alignas(64) partial_sum_t partial[MAX_COMPARE_THREADS];
+    _Alignas(64) uint64_t tile_sse[MAX_COMPARE_THREADS][IMAGE_COMPARE_MAX_TILES];
+} pool = {
+    .nthreads = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .dispatch_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t sse_span(const uint8_t *row1, const uint8_t *row2,
+                         uint32_t x0, uint32_t x1) {
+    uint64_t sse = 0;
+
+    // Process each pixel's BGRA channels
+    for (uint32_t x = x0; x < x1; x++) {
+        for (int c = 0; c < BGRA_CHANNELS; c++) {
+            int diff = row1[x * BGRA_CHANNELS + c] - row2[x * BGRA_CHANNELS + c];
+            sse += (uint64_t)(diff * diff);
+        }
+    }
+
+    return sse;
+}
+
+// Sum rows [y0, y1); with a tile grid, also accumulate each tile's share
+// into tile_sse (which the caller has zeroed)
+static uint64_t sse_rows(const mse_job_t *job, uint32_t y0, uint32_t y1,
+                         uint64_t *tile_sse) {
+    uint64_t sse = 0;
+
+    for (uint32_t y = y0; y < y1; y++) {
+        const uint8_t *row1 = job->img1 + (size_t)y * job->stride;
+        const uint8_t *row2 = job->img2 + (size_t)y * job->stride;
+        
+        if (!job->tiles_x) {
+            sse += sse_span(row1, row2, 0, job->width);
+            continue;
+        }
+        
+        uint64_t *tile_row = tile_sse +
+            (size_t)((uint64_t)y * job->tiles_y / job->height) * job->tiles_x;
+        for (uint32_t tx = 0; tx < job->tiles_x; tx++) {
+            uint32_t x0 = (uint32_t)((uint64_t)tx * job->width / job->tiles_x);
+            uint32_t x1 = (uint32_t)((uint64_t)(tx + 1) * job->width / job->tiles_x);
+            uint64_t part = sse_span(row1, row2, x0, x1);
+            tile_row[tx] += part;
+            sse += part;
+        }
+    }
+
+    return sse;
+}
+
+static void run_slice(int index) {
+    const mse_job_t *job = &pool.job;
+    uint32_t y0 = (uint32_t)index * job->rows_per_thread;
+    uint32_t y1 = y0 + job->rows_per_thread;
+    if (y0 > job->height) y0 = job->height;
+    if (y1 > job->height) y1 = job->height;
+
+    if (job->tiles_x) {
+        memset(pool.tile_sse[index], 0,
+               (size_t)job->tiles_x * job->tiles_y * sizeof(uint64_t));
+    }
+    pool.partial[index].sse = sse_rows(job, y0, y1, pool.tile_sse[index]);
+}
+
+static void *compare_worker(void *arg) {
+    int index = (int)(intptr_t)arg;
+    uint64_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stop && pool.generation == seen) {
+            pthread_cond_wait(&pool.start_cond, &pool.lock);
+        }
+        if (pool.stop) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_slice(index);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.done_cond);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+// Pin worker to the n-th CPU in our affinity mask so slices stay cache-warm
+static void pin_worker(pthread_t thread, int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) return;
+    n %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (n-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+int image_compare_init(int threads) {
+    if (pool.started) {
+        return pool.nthreads;
+    }
+
+    if (threads <= 0) {
+        cpu_set_t allowed;
+        threads = 1;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            threads = CPU_COUNT(&allowed);
+        }
+    }
+    if (threads > MAX_COMPARE_THREADS) {
+        threads = MAX_COMPARE_THREADS;
+    }
+    if (threads <= 1) {
+        pool.nthreads = 1;
+        return 1;
+    }
+
+    pool.stop = 0;
+    pool.generation = 0;
+
+    // Worker 0 is the calling thread, so spawn threads - 1 helpers
+    int spawned = 1;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool.workers[i], NULL, compare_worker, (void *)(intptr_t)i) != 0) {
+            break;
+        }
+        pin_worker(pool.workers[i], i);
+        spawned++;
+    }
+
+    if (spawned == 1) {
+        pool.nthreads = 1;
+        return -EAGAIN;
+    }
+
+    pool.nthreads = spawned;
+    pool.started = 1;
+    return spawned;
+}
+
+void image_compare_shutdown(void) {
+    if (!pool.started) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.nthreads; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+
+    pool.started = 0;
+    pool.nthreads = 1;
+}
+
+int image_compare_threads(void) {
+    return pool.nthreads;
+}
+
+static uint64_t sse_parallel(const mse_job_t *job, uint64_t *tile_sse) {
+    int n = pool.nthreads;
+
+    pool.job = *job;
+    pool.job.rows_per_thread = (job->height + n - 1) / n;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.pending = n - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_slice(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    uint64_t sse = 0;
+    size_t tiles = (size_t)job->tiles_x * job->tiles_y;
+    for (int i = 0; i < n; i++) {
+        sse += pool.partial[i].sse;
+        for (size_t t = 0; t < tiles; t++) {
+            tile_sse[t] += pool.tile_sse[i][t];
+        }
+    }
+    return sse;
+}
+
+float calculate_mse_tiles_bgra(const uint8_t *img1, const uint8_t *img2,
+                               uint32_t width, uint32_t height,
+                               uint32_t stride1, uint32_t stride2,
+                               uint32_t tiles_x, uint32_t tiles_y,
+                               float *tile_mse) {
     // Validate inputs
     if (!img1 || !img2) {
         return -1.0f; // Error: null pointer
@@ -21,26 +272,142 @@ float calculate_mse_bgra(const uint8_t *img1, const uint8_t *img2,
         return -1.0f; // Error: stride too small
     }
     
+    // Tiles must not be empty, and the grid must fit the pool's buffers
+    size_t tiles = (size_t)tiles_x * tiles_y;
+    if (tiles_x && (!tile_mse || !tiles_y || tiles > IMAGE_COMPARE_MAX_TILES ||
+                    tiles_x > width || tiles_y > height)) {
+        return -1.0f;
+    }
+    
+    mse_job_t job = {
+        .img1 = img1,
+        .img2 = img2,
+        .width = width,
+        .height = height,
+        .stride = stride1,
+        .tiles_x = tiles_x,
+        .tiles_y = tiles_x ? tiles_y : 0,
+    };
+    uint64_t tile_sse[IMAGE_COMPARE_MAX_TILES] = {0};
     uint64_t sse = 0;
-    size_t pixel_count = 0;
+    size_t pixel_count = (size_t)width * height;
+    
+    // Split rows across the pool for large frames; a concurrent caller
+    // that finds the pool busy simply runs single-threaded
+    if (pool.started && pixel_count >= IMAGE_COMPARE_MT_MIN_PIXELS &&
+        pthread_mutex_trylock(&pool.dispatch_lock) == 0) {
+        sse = sse_parallel(&job, tile_sse);
+        pthread_mutex_unlock(&pool.dispatch_lock);
+    } else {
+        sse = sse_rows(&job, 0, height, tile_sse);
+    }
+    
+    // Convert SSE to MSE (normalized to 0-1 range). Row y lands in tile
+    // y * tiles_y / height, so tile ty starts at ceil(ty * height / tiles_y)
+    for (uint32_t ty = 0; ty < job.tiles_y; ty++) {
+        uint64_t first = ((uint64_t)ty * height + tiles_y - 1) / tiles_y;
+        uint64_t last = ((uint64_t)(ty + 1) * height + tiles_y - 1) / tiles_y;
+        uint64_t rows = last - first;
+        for (uint32_t tx = 0; tx < tiles_x; tx++) {
+            uint64_t cols = (uint64_t)(tx + 1) * width / tiles_x - (uint64_t)tx * width / tiles_x;
+            size_t t = (size_t)ty * tiles_x + tx;
+            tile_mse[t] = (float)tile_sse[t] / (rows * cols * BGRA_CHANNELS * 255.0f * 255.0f);
+        }
+    }
+    
+    pixel_count *= BGRA_CHANNELS;
+    if (pixel_count == 0) return 0.0f;
+    return (float)sse / (pixel_count * 255.0f * 255.0f);
+}
+
+float calculate_mse_bgra(const uint8_t *img1, const uint8_t *img2, 
+                         uint32_t width, uint32_t height, 
+                         uint32_t stride1, uint32_t stride2) {
+    return calculate_mse_tiles_bgra(img1, img2, width, height, stride1, stride2,
+                                    0, 0, NULL);
+}
+
+void downscale_gray_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                         uint32_t stride, uint8_t *out,
+                         uint32_t out_width, uint32_t out_height) {
+    size_t cells = (size_t)out_width * out_height;
+    uint64_t *sums = calloc(cells, sizeof(uint64_t));
+    uint32_t *cell_x = malloc(((size_t)width + 1) * sizeof(uint32_t));
+    uint64_t *cols = calloc(out_width, sizeof(uint64_t));
+    uint64_t *rows = calloc(out_height, sizeof(uint64_t));
+    
+    if (!sums || !cell_x || !cols || !rows || !img) {
+        memset(out, 0, cells);
+        free(sums);
+        free(cell_x);
+        free(cols);
+        free(rows);
+        return;
+    }
+    
+    // Map each column to its output cell once instead of dividing per pixel,
+    // and count what lands in each cell with that same mapping
+    for (uint32_t x = 0; x < width; x++) {
+        cell_x[x] = (uint32_t)((uint64_t)x * out_width / width);
+        cols[cell_x[x]]++;
+    }
     
-    // Process all pixels
     for (uint32_t y = 0; y < height; y++) {
-        const uint8_t *row1 = img1 + y * stride1;
-        const uint8_t *row2 = img2 + y * stride2;
+        const uint8_t *row = img + (size_t)y * stride;
+        uint32_t cy = (uint32_t)((uint64_t)y * out_height / height);
+        uint64_t *cell_row = sums + (size_t)cy * out_width;
+        rows[cy]++;
         
-        // Process each pixel's BGRA channels
         for (uint32_t x = 0; x < width; x++) {
-            for (int c = 0; c < BGRA_CHANNELS; c++) {
-                int diff = row1[x * BGRA_CHANNELS + c] - row2[x * BGRA_CHANNELS + c];
-                sse += (uint64_t)(diff * diff);
-            }
+            const uint8_t *px = row + x * BGRA_CHANNELS;
+            // BT.601 luma in fixed point: B, G, R weights sum to 256
+            cell_row[cell_x[x]] += (uint32_t)(29 * px[0] + 150 * px[1] + 77 * px[2]) >> 8;
         }
     }
     
-    pixel_count = (size_t)width * height * BGRA_CHANNELS;
+    for (uint32_t cy = 0; cy < out_height; cy++) {
+        for (uint32_t cx = 0; cx < out_width; cx++) {
+            uint64_t count = rows[cy] * cols[cx];
+            size_t i = (size_t)cy * out_width + cx;
+            uint64_t mean = count ? sums[i] / count : 0;
+            out[i] = (uint8_t)(mean > 255 ? 255 : mean);
+        }
+    }
     
-    // Convert SSE to MSE (normalized to 0-1 range)
-    if (pixel_count == 0) return 0.0f;
-    return (float)sse / (pixel_count * 255.0f * 255.0f);
-}
\ No newline at end of file
+    free(sums);
+    free(cell_x);
+    free(cols);
+    free(rows);
+}
+
+void compute_signature_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                            uint32_t stride, uint8_t signature[IMAGE_SIGNATURE_SIZE]) {
+    downscale_gray_bgra(img, width, height, stride, signature,
+                        IMAGE_SIGNATURE_DIM, IMAGE_SIGNATURE_DIM);
+}
+
+uint64_t compute_dhash_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                            uint32_t stride) {
+    uint8_t grid[9 * 8];
+    uint64_t hash = 0;
+    
+    downscale_gray_bgra(img, width, height, stride, grid, 9, 8);
+    
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            hash <<= 1;
+            hash |= grid[y * 9 + x] > grid[y * 9 + x + 1];
+        }
+    }
+    
+    return hash;
+}
+
+uint32_t signature_distance(const uint8_t *sig1, const uint8_t *sig2) {
+    uint32_t sum = 0;
+    for (int i = 0; i < IMAGE_SIGNATURE_SIZE; i++) {
+        int diff = sig1[i] - sig2[i];
+        sum += (uint32_t)(diff * diff);
+    }
+    return sum;
+}
@@ -3,15 +3,68 @@
 
 #include <stdint.h>
 
+// Frames with fewer pixels than this are always compared on the calling
+// thread; below ~1440p the wake-up cost of the pool outweighs the gain.
+#define IMAGE_COMPARE_MT_MIN_PIXELS (2560u * 1440u)
+
+// Start the persistent comparison worker pool.
+// threads <= 0 uses every CPU we are allowed to run on, 1 disables the pool.
+// Returns the number of threads used for large frames, or -errno.
+int image_compare_init(int threads);
+
+// Stop and join the worker pool (safe to call when it was never started)
+void image_compare_shutdown(void);
+
+// Number of threads a large comparison is split across (1 = single-thread)
+int image_compare_threads(void);
+
 // Calculate Mean Squared Error between two BGRA images
 // Returns MSE normalized to 0-1 range (0 = identical, 1 = completely different)
 float calculate_mse_bgra(const uint8_t *img1, const uint8_t *img2, 
                          uint32_t width, uint32_t height, 
                          uint32_t stride1, uint32_t stride2);
 
+// Side of the grayscale thumbnail used as a frame signature
+#define IMAGE_SIGNATURE_DIM 16
+#define IMAGE_SIGNATURE_SIZE (IMAGE_SIGNATURE_DIM * IMAGE_SIGNATURE_DIM)
+
+// Box-average a BGRA image down to an out_width x out_height luma grid
+void downscale_gray_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                         uint32_t stride, uint8_t *out,
+                         uint32_t out_width, uint32_t out_height);
+
+// 16x16 grayscale signature of a BGRA image
+void compute_signature_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                            uint32_t stride, uint8_t signature[IMAGE_SIGNATURE_SIZE]);
+
+// 64-bit difference hash (dHash): each bit says whether a cell of a 9x8
+// luma grid is brighter than its right neighbour
+uint64_t compute_dhash_bgra(const uint8_t *img, uint32_t width, uint32_t height,
+                            uint32_t stride);
+
+// Sum of squared differences between two signatures
+uint32_t signature_distance(const uint8_t *sig1, const uint8_t *sig2);
+
+// Number of differing bits between two perceptual hashes
+static inline int hash_distance(uint64_t hash1, uint64_t hash2) {
+    return __builtin_popcountll(hash1 ^ hash2);
+}
+
+// Largest tile grid calculate_mse_tiles_bgra accepts (tiles_x * tiles_y)
+#define IMAGE_COMPARE_MAX_TILES 256
+
+// Like calculate_mse_bgra, but in the same pass also writes the MSE of each
+// cell of a tiles_x x tiles_y grid (row-major) to tile_mse.
+// Returns -1 on invalid input or an unsupported grid.
+float calculate_mse_tiles_bgra(const uint8_t *img1, const uint8_t *img2,
+                               uint32_t width, uint32_t height,
+                               uint32_t stride1, uint32_t stride2,
+                               uint32_t tiles_x, uint32_t tiles_y,
+                               float *tile_mse);
+
 // Convert MSE to similarity score (1 - MSE)
 static inline float mse_to_similarity(float mse) {
     return 1.0f - mse;
 }
 
-#endif // IMAGE_COMPARE_H
\ No newline at end of file
+#endif // IMAGE_COMPARE_H
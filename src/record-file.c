@@ -0,0 +1,128 @@
+#include "record-file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int header_matches(const record_file_header_t *header, const char *magic,
+                          uint32_t version, uint32_t record_size) {
+    return memcmp(header->magic, magic, sizeof(header->magic)) == 0 &&
+           header->version == version &&
+           header->record_size == record_size;
+}
+
+int record_file_open_append(const char *path, const char *magic,
+                            uint32_t version, uint32_t record_size) {
+    int fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    struct stat st;
+    record_file_header_t existing;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+        (pread(fd, &existing, sizeof(existing), 0) != (ssize_t)sizeof(existing) ||
+         !header_matches(&existing, magic, version, record_size))) {
+        // Appending to another layout would misalign every record after it
+        char old[4096 + 8];
+        snprintf(old, sizeof(old), "%s.old", path);
+        close(fd);
+        if (rename(path, old) < 0) {
+            return -errno;
+        }
+        fprintf(stderr, "%s has an old layout, moved to %s\n", path, old);
+        fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return -errno;
+        }
+    }
+    
+    int r = 0;
+    if (fstat(fd, &st) < 0) {
+        r = -errno;
+    } else if (st.st_size == 0) {
+        record_file_header_t header = {
+            .version = version,
+            .record_size = record_size,
+        };
+        memcpy(header.magic, magic, sizeof(header.magic));
+        r = write_all(fd, &header, sizeof(header));
+    } else {
+        // Drop a torn tail left by a crash so records stay aligned
+        off_t body = st.st_size - (off_t)sizeof(record_file_header_t);
+        off_t torn = body > 0 ? body % (off_t)record_size : 0;
+        if (torn && ftruncate(fd, st.st_size - torn) < 0) {
+            r = -errno;
+        }
+    }
+    
+    if (r < 0) {
+        close(fd);
+        return r;
+    }
+    return fd;
+}
+
+int record_file_open(const char *path, const char *magic,
+                     uint32_t version, uint32_t record_size,
+                     record_file_t *file) {
+    memset(file, 0, sizeof(*file));
+    
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    if ((size_t)st.st_size < sizeof(record_file_header_t)) {
+        close(fd);
+        return -EBADMSG;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    
+    const record_file_header_t *header = map;
+    if (!header_matches(header, magic, version, record_size)) {
+        munmap(map, st.st_size);
+        return -EBADMSG;
+    }
+    
+    file->map = map;
+    file->map_size = st.st_size;
+    file->records = header + 1;
+    file->count = (st.st_size - sizeof(*header)) / record_size;
+    return 0;
+}
+
+void record_file_close(record_file_t *file) {
+    if (file->map) {
+        munmap(file->map, file->map_size);
+    }
+    memset(file, 0, sizeof(*file));
+}
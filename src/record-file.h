@@ -0,0 +1,44 @@
+#ifndef RECORD_FILE_H
+#define RECORD_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only files of fixed-size records, shared by the similarity index
+// and the capture timeline.
+//
+// A record file is a record_file_header_t followed by records of a single
+// size, so readers can mmap it and use the body as an array. A torn record
+// at the end (crash mid-append) is ignored by readers and trimmed by the
+// next writer.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} record_file_header_t;
+
+typedef struct {
+    const void *records;
+    size_t count;
+    void *map;
+    size_t map_size;
+} record_file_t;
+
+// Write all of buf, retrying short writes and EINTR. Returns 0 or -errno.
+int write_all(int fd, const void *buf, size_t len);
+
+// Open path for appending, writing the header if the file is new and
+// trimming a torn tail otherwise. A file with another magic, version or
+// record size is renamed to <path>.old and a new one is started.
+// Returns an O_APPEND fd or -errno.
+int record_file_open_append(const char *path, const char *magic,
+                            uint32_t version, uint32_t record_size);
+
+// Map path read-only after checking its header. Returns 0 or -errno
+// (-EBADMSG for a foreign or outdated file).
+int record_file_open(const char *path, const char *magic,
+                     uint32_t version, uint32_t record_size,
+                     record_file_t *file);
+void record_file_close(record_file_t *file);
+
+#endif // RECORD_FILE_H
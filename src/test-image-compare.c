@@ -3,6 +3,7 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <time.h>
 #include "image-compare.h"
 
 #define BGRA_CHANNELS 4
@@ -74,12 +75,232 @@ static void test_different_dimensions() {
     printf("PASSED (correctly rejected)\n");
 }
 
-int main() {
+static double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// xorshift64: much cheaper than rand() for filling large test frames
+static void fill_random(uint8_t *buf, size_t size, uint64_t seed) {
+    uint64_t x = seed;
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, 8);
+    }
+    for (size_t i = size & ~(size_t)7; i < size; i++) {
+        buf[i] = (uint8_t)i;
+    }
+}
+
+static void test_multithreaded_matches_single() {
+    printf("Test 4: Multi-threaded MSE matches single-thread (4K)... ");
+    
+    const uint32_t width = 3840, height = 2160;
+    uint32_t stride = width * BGRA_CHANNELS;
+    size_t img_size = (size_t)stride * height;
+    
+    uint8_t *img1 = malloc(img_size);
+    uint8_t *img2 = malloc(img_size);
+    
+    fill_random(img1, img_size, 42);
+    fill_random(img2, img_size, 4242);
+    
+    float single = calculate_mse_bgra(img1, img2, width, height, stride, stride);
+    
+    int threads = image_compare_init(4);
+    assert(threads >= 1);
+    float multi = calculate_mse_bgra(img1, img2, width, height, stride, stride);
+    image_compare_shutdown();
+    
+    assert(single == multi);
+    assert(image_compare_threads() == 1);
+    
+    free(img1);
+    free(img2);
+    printf("PASSED (MSE: %.6f, %d threads)\n", multi, threads);
+}
+
+static void test_signature_and_dhash() {
+    printf("Test 5: Signature and perceptual hash... ");
+    
+    uint32_t stride = TEST_WIDTH * BGRA_CHANNELS;
+    size_t img_size = (size_t)stride * TEST_HEIGHT;
+    
+    uint8_t *img1 = malloc(img_size);
+    uint8_t *img2 = malloc(img_size);
+    
+    // Horizontal gradient, and the same gradient with a small patch changed
+    for (uint32_t y = 0; y < TEST_HEIGHT; y++) {
+        for (uint32_t x = 0; x < TEST_WIDTH; x++) {
+            uint8_t v = (uint8_t)(x * 255 / TEST_WIDTH);
+            memset(img1 + (size_t)y * stride + x * BGRA_CHANNELS, v, BGRA_CHANNELS);
+        }
+    }
+    memcpy(img2, img1, img_size);
+    for (uint32_t y = 0; y < 40; y++) {
+        memset(img2 + (size_t)y * stride, 0xff, 40 * BGRA_CHANNELS);
+    }
+    
+    uint8_t sig1[IMAGE_SIGNATURE_SIZE], sig2[IMAGE_SIGNATURE_SIZE];
+    compute_signature_bgra(img1, TEST_WIDTH, TEST_HEIGHT, stride, sig1);
+    compute_signature_bgra(img2, TEST_WIDTH, TEST_HEIGHT, stride, sig2);
+    
+    // Gradient increases left to right, so every cell is darker than the next
+    uint64_t hash1 = compute_dhash_bgra(img1, TEST_WIDTH, TEST_HEIGHT, stride);
+    uint64_t hash2 = compute_dhash_bgra(img2, TEST_WIDTH, TEST_HEIGHT, stride);
+    assert(hash1 == 0);
+    assert(hash_distance(hash1, hash2) <= 1);
+    
+    assert(sig1[0] < sig1[IMAGE_SIGNATURE_DIM - 1]);
+    assert(signature_distance(sig1, sig1) == 0);
+    assert(signature_distance(sig1, sig2) > 0);
+    
+    // A completely different frame has a distant signature
+    memset(img2, 0, img_size);
+    for (uint32_t y = 0; y < TEST_HEIGHT; y += 2) {
+        memset(img2 + (size_t)y * stride, 0xff, stride);
+    }
+    compute_signature_bgra(img2, TEST_WIDTH, TEST_HEIGHT, stride, sig2);
+    assert(signature_distance(sig1, sig2) > signature_distance(sig1, sig1) + 1000);
+
+    // A uniform frame stays uniform whether or not the cells divide evenly
+    const uint32_t sizes[][2] = { { 1920, 1080 }, { 2560, 1440 } };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t w = sizes[s][0], h = sizes[s][1];
+        uint8_t *white = malloc((size_t)w * h * BGRA_CHANNELS);
+        memset(white, 0xff, (size_t)w * h * BGRA_CHANNELS);
+        
+        assert(compute_dhash_bgra(white, w, h, w * BGRA_CHANNELS) == 0);
+        compute_signature_bgra(white, w, h, w * BGRA_CHANNELS, sig2);
+        for (int i = 0; i < IMAGE_SIGNATURE_SIZE; i++) {
+            assert(sig2[i] == 255);
+        }
+        free(white);
+    }
+    
+    free(img1);
+    free(img2);
+    printf("PASSED (hash distance: %d)\n", hash_distance(hash1, hash2));
+}
+    
+static void test_tile_mse() {
+    printf("Test 6: Per-tile MSE... ");
+    
+    uint32_t stride = TEST_WIDTH * BGRA_CHANNELS;
+    size_t img_size = (size_t)stride * TEST_HEIGHT;
+    const uint32_t tiles_x = 16, tiles_y = 16;
+    float tiles[16 * 16];
+    
+    uint8_t *img1 = calloc(1, img_size);
+    uint8_t *img2 = calloc(1, img_size);
+    
+    // Change a 20x20 patch inside the bottom-right tile only
+    for (uint32_t y = TEST_HEIGHT - 30; y < TEST_HEIGHT - 10; y++) {
+        memset(img2 + (size_t)y * stride + (TEST_WIDTH - 30) * BGRA_CHANNELS, 0xff,
+               20 * BGRA_CHANNELS);
+    }
+    
+    float plain = calculate_mse_bgra(img1, img2, TEST_WIDTH, TEST_HEIGHT, stride, stride);
+    float mse = calculate_mse_tiles_bgra(img1, img2, TEST_WIDTH, TEST_HEIGHT, stride, stride,
+                                         tiles_x, tiles_y, tiles);
+    assert(mse == plain);
+    
+    for (uint32_t t = 0; t < tiles_x * tiles_y - 1; t++) {
+        assert(tiles[t] == 0.0f);
+    }
+    // All of the error sits in the last tile: columns 1800-1919 and rows
+    // 1013-1079 (row y belongs to tile y * 16 / 1080), so 120x67 pixels
+    double total = (double)mse * TEST_WIDTH * TEST_HEIGHT;
+    assert(fabs(tiles[tiles_x * tiles_y - 1] * 120.0 * 67.0 - total) < total * 1e-5);
+    
+    // A completely different frame scores 1.0 in every tile, however
+    // unevenly the grid divides the frame
+    memset(img2, 0xff, img_size);
+    calculate_mse_tiles_bgra(img1, img2, TEST_WIDTH, TEST_HEIGHT, stride, stride,
+                             tiles_x, tiles_y, tiles);
+    for (uint32_t t = 0; t < tiles_x * tiles_y; t++) {
+        assert(fabsf(tiles[t] - 1.0f) < 1e-6f);
+    }
+    
+    // Same result when split across the worker pool (frame above the cutoff)
+    const uint32_t width = 3840, height = 2160;
+    uint32_t big_stride = width * BGRA_CHANNELS;
+    uint8_t *big1 = calloc(1, (size_t)big_stride * height);
+    uint8_t *big2 = calloc(1, (size_t)big_stride * height);
+    for (size_t i = 0; i < (size_t)big_stride * height; i += 4099) {
+        big2[i] = (uint8_t)i;
+    }
+    float single_tiles[16 * 16];
+    float single = calculate_mse_tiles_bgra(big1, big2, width, height, big_stride, big_stride,
+                                            tiles_x, tiles_y, single_tiles);
+    image_compare_init(3);
+    float multi = calculate_mse_tiles_bgra(big1, big2, width, height, big_stride, big_stride,
+                                           tiles_x, tiles_y, tiles);
+    image_compare_shutdown();
+    assert(single == multi);
+    assert(memcmp(single_tiles, tiles, sizeof(tiles)) == 0);
+    
+    // Grids larger than IMAGE_COMPARE_MAX_TILES are rejected
+    assert(calculate_mse_tiles_bgra(img1, img2, TEST_WIDTH, TEST_HEIGHT, stride, stride,
+                                    32, 32, tiles) == -1.0f);
+    
+    free(img1);
+    free(img2);
+    free(big1);
+    free(big2);
+    printf("PASSED\n");
+}
+
+static void benchmark_mse() {
+    const uint32_t width = 7680, height = 4320;
+    const int iterations = 10;
+    uint32_t stride = width * BGRA_CHANNELS;
+    size_t img_size = (size_t)stride * height;
+    
+    uint8_t *img1 = malloc(img_size);
+    uint8_t *img2 = malloc(img_size);
+    memset(img1, 0x40, img_size);
+    memset(img2, 0x41, img_size);
+    
+    printf("\nBenchmark: %ux%u BGRA, %d iterations\n", width, height, iterations);
+    
+    int counts[] = { 1, 2, 4, 0 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        int threads = image_compare_init(counts[i]);
+        if (threads < 1) threads = 1;
+        
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int it = 0; it < iterations; it++) {
+            calculate_mse_bgra(img1, img2, width, height, stride, stride);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        double ms = elapsed_ms(&start, &end) / iterations;
+        printf("  %2d thread(s): %8.2f ms/frame  %7.2f GB/s\n", threads, ms,
+               2.0 * img_size / (ms * 1e6));
+        image_compare_shutdown();
+    }
+    
+    free(img1);
+    free(img2);
+}
+
+int main(int argc, char **argv) {
     printf("Running image comparison tests...\n\n");
     
     test_identical_images();
     test_completely_different();
     test_different_dimensions();
+    test_multithreaded_matches_single();
+    test_signature_and_dhash();
+    test_tile_mse();
+    
+    // The benchmark allocates two 8K frames, so it is opt-in
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        benchmark_mse();
+    }
     
     printf("\nAll tests passed!\n");
     return 0;
@@ -0,0 +1,313 @@
+// Several checks below call the code under test, keep them in every build
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "record-file.h"
+#include "frame-index.h"
+#include "timeline.h"
+
+#define BGRA_CHANNELS 4
+
+static char dir[] = "/tmp/fastshot-test-XXXXXX";
+static char index_path[4096];
+
+static frame_index_record_t make_record(int64_t timestamp, uint64_t dhash,
+                                        uint8_t shade, const char *filename) {
+    frame_index_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.dhash = dhash;
+    record.width = 1920;
+    record.height = 1080;
+    memset(record.signature, shade, sizeof(record.signature));
+    snprintf(record.filename, sizeof(record.filename), "%s", filename);
+    return record;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+static void remove_all(void) {
+    char old[4096 + 8];
+    snprintf(old, sizeof(old), "%s.old", index_path);
+    unlink(index_path);
+    unlink(old);
+    
+    char path[4096 + 16];
+    snprintf(path, sizeof(path), "%s/%s", dir, TIMELINE_FILENAME);
+    unlink(path);
+}
+
+static void test_round_trip() {
+    printf("Test 1: Append and reopen... ");
+    
+    remove_all();
+    const char *long_name = "a-batch-output-name-well-past-the-old-32-byte-limit.png";
+    for (int i = 0; i < 3; i++) {
+        frame_index_record_t record = make_record(1000 + i, 0x1234u + i, (uint8_t)i,
+                                                  i == 2 ? long_name : "short.png");
+        assert(frame_index_append(dir, &record) == 0);
+    }
+    
+    frame_index_t index;
+    assert(frame_index_open(index_path, &index) == 0);
+    assert(index.count == 3);
+    for (int i = 0; i < 3; i++) {
+        assert(index.records[i].timestamp == 1000 + i);
+        assert(index.records[i].dhash == 0x1234u + i);
+        assert(index.records[i].signature[0] == i);
+    }
+    assert(strcmp(index.records[2].filename, long_name) == 0);
+    frame_index_close(&index);
+    assert(index.map == NULL);
+    
+    printf("PASSED\n");
+}
+
+static void test_torn_tail() {
+    printf("Test 2: Torn tail... ");
+    
+    // Half a record, as left by a crash mid-append
+    int fd = open(index_path, O_WRONLY|O_APPEND);
+    assert(fd >= 0);
+    char junk[sizeof(frame_index_record_t) / 2];
+    memset(junk, 0xab, sizeof(junk));
+    assert(write_all(fd, junk, sizeof(junk)) == 0);
+    close(fd);
+    
+    // Readers ignore it
+    frame_index_t index;
+    assert(frame_index_open(index_path, &index) == 0);
+    assert(index.count == 3);
+    frame_index_close(&index);
+    
+    // The next writer trims it, so the new record stays aligned
+    frame_index_record_t record = make_record(2000, 42, 7, "after.png");
+    assert(frame_index_append(dir, &record) == 0);
+    assert(file_size(index_path) ==
+           (off_t)(sizeof(record_file_header_t) + 4 * sizeof(frame_index_record_t)));
+    assert(frame_index_open(index_path, &index) == 0);
+    assert(index.count == 4);
+    assert(index.records[3].timestamp == 2000);
+    assert(strcmp(index.records[3].filename, "after.png") == 0);
+    frame_index_close(&index);
+    
+    printf("PASSED\n");
+}
+
+static void test_foreign_layout() {
+    printf("Test 3: Foreign layout... ");
+    
+    // A version 1 index: same magic, older record size
+    remove_all();
+    record_file_header_t header = { .version = 1, .record_size = 312 };
+    memcpy(header.magic, FRAME_INDEX_MAGIC, sizeof(header.magic));
+    int fd = open(index_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write_all(fd, &header, sizeof(header)) == 0);
+    char body[312 * 2] = {0};
+    assert(write_all(fd, body, sizeof(body)) == 0);
+    close(fd);
+    
+    frame_index_t index;
+    assert(frame_index_open(index_path, &index) == -EBADMSG);
+    
+    // Appending moves it aside instead of misaligning it
+    frame_index_record_t record = make_record(3000, 1, 1, "new.png");
+    assert(frame_index_append(dir, &record) == 0);
+    
+    char old[4096 + 8];
+    snprintf(old, sizeof(old), "%s.old", index_path);
+    assert(file_size(old) == (off_t)(sizeof(header) + sizeof(body)));
+    assert(frame_index_open(index_path, &index) == 0);
+    assert(index.count == 1);
+    assert(index.records[0].timestamp == 3000);
+    frame_index_close(&index);
+    
+    // Files that are too short to hold a header are rejected too
+    fd = open(index_path, O_WRONLY|O_TRUNC);
+    assert(fd >= 0);
+    close(fd);
+    assert(frame_index_open(index_path, &index) == -EBADMSG);
+    
+    printf("PASSED\n");
+}
+
+static void test_query() {
+    printf("Test 4: Query ranking and filters... ");
+    
+    remove_all();
+    const uint64_t query = 0xf0f0f0f0f0f0f0f0ull;
+    // dhash distance from query: 0, 3, 3, 1, 20
+    frame_index_record_t records[] = {
+        make_record(100, query, 10, "exact.png"),
+        make_record(200, query ^ 0x7, 50, "three-far.png"),
+        make_record(300, query ^ 0x70, 12, "three-near.png"),
+        make_record(400, query ^ 0x100, 10, "one.png"),
+        make_record(500, query ^ 0xfffff, 10, "twenty.png"),
+    };
+    for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++) {
+        assert(frame_index_append(dir, &records[i]) == 0);
+    }
+    
+    frame_index_t index;
+    assert(frame_index_open(index_path, &index) == 0);
+    
+    uint8_t signature[IMAGE_SIGNATURE_SIZE];
+    memset(signature, 10, sizeof(signature));
+    frame_index_match_t matches[8];
+    
+    // Nearest hash first, ties broken by signature distance
+    int found = frame_index_query(&index, query, signature, 12, INT64_MIN, INT64_MAX,
+                                  matches, 8);
+    assert(found == 4);
+    assert(matches[0].record == 0 && matches[0].distance == 0);
+    assert(matches[1].record == 3 && matches[1].distance == 1);
+    assert(matches[2].record == 2 && matches[2].distance == 3);
+    assert(matches[3].record == 1 && matches[3].distance == 3);
+    assert(matches[2].signature_distance < matches[3].signature_distance);
+    
+    // max_matches keeps only the best
+    found = frame_index_query(&index, query, signature, 64, INT64_MIN, INT64_MAX,
+                              matches, 2);
+    assert(found == 2);
+    assert(matches[0].record == 0 && matches[1].record == 3);
+    
+    // from/to are inclusive and applied before ranking
+    found = frame_index_query(&index, query, NULL, 64, 200, 400, matches, 8);
+    assert(found == 3);
+    assert(matches[0].record == 3);
+    assert(matches[0].signature_distance == 0);
+    for (int i = 0; i < found; i++) {
+        int64_t ts = index.records[matches[i].record].timestamp;
+        assert(ts >= 200 && ts <= 400);
+    }
+    
+    // Nothing within range
+    assert(frame_index_query(&index, ~query, NULL, 12, INT64_MIN, INT64_MAX, matches, 8) == 0);
+    
+    frame_index_close(&index);
+    printf("PASSED\n");
+}
+
+static void test_timeline_records() {
+    printf("Test 5: Timeline layout and round trip... ");
+    
+    // The on-disk layouts are part of the file formats
+    assert(sizeof(record_file_header_t) == 16);
+    assert(sizeof(frame_index_record_t) == 536);
+    assert(sizeof(timeline_record_t) == 88);
+    assert(offsetof(timeline_record_t, flags) == 16);
+    assert(offsetof(timeline_record_t, dirty) == 24);
+    assert(offsetof(timeline_record_t, filename) == 56);
+    
+    remove_all();
+    int fd = timeline_open_append(dir);
+    assert(fd >= 0);
+    for (int i = 0; i < 3; i++) {
+        timeline_record_t record = {
+            .timestamp_us = 1000000LL * i,
+            .capture_us = 100 + i,
+            .similarity = i ? 0.5f : -1.0f,
+            .flags = i ? TIMELINE_SAVED : TIMELINE_SAVED | TIMELINE_FIRST,
+        };
+        snprintf(record.filename, sizeof(record.filename), "f%d.png", i);
+        assert(timeline_append(fd, &record) == 0);
+    }
+    assert(write_all(fd, "torn", 4) == 0);
+    close(fd);
+    
+    // Reopening for append trims the torn tail
+    fd = timeline_open_append(dir);
+    assert(fd >= 0);
+    close(fd);
+    
+    char path[4096 + 16];
+    snprintf(path, sizeof(path), "%s/%s", dir, TIMELINE_FILENAME);
+    assert(file_size(path) == (off_t)(sizeof(record_file_header_t) + 3 * sizeof(timeline_record_t)));
+    
+    timeline_t timeline;
+    assert(timeline_open(path, &timeline) == 0);
+    assert(timeline.count == 3);
+    assert(timeline.records[0].flags == (TIMELINE_SAVED | TIMELINE_FIRST));
+    assert(timeline.records[2].timestamp_us == 2000000);
+    assert(timeline.records[2].capture_us == 102);
+    assert(timeline.records[2].similarity == 0.5f);
+    assert(strcmp(timeline.records[1].filename, "f1.png") == 0);
+    timeline_close(&timeline);
+    
+    // A similarity index is not a timeline
+    frame_index_record_t other = make_record(1, 1, 1, "other.png");
+    assert(frame_index_append(dir, &other) == 0);
+    assert(timeline_open(index_path, &timeline) == -EBADMSG);
+    
+    printf("PASSED\n");
+}
+
+static void test_timeline_dirty() {
+    printf("Test 6: Timeline dirty tiles... ");
+    
+    const uint32_t width = 1920, height = 1080, stride = width * BGRA_CHANNELS;
+    uint8_t *img1 = calloc(1, (size_t)stride * height);
+    uint8_t *img2 = calloc(1, (size_t)stride * height);
+    float tiles[TIMELINE_TILES];
+    timeline_record_t record;
+    
+    // A single changed pixel stays below the threshold
+    memset(img2 + (size_t)500 * stride + 700 * BGRA_CHANNELS, 0xff, BGRA_CHANNELS);
+    calculate_mse_tiles_bgra(img1, img2, width, height, stride, stride,
+                             TIMELINE_TILES_X, TIMELINE_TILES_Y, tiles);
+    memset(&record, 0xff, sizeof(record));
+    timeline_set_dirty(&record, tiles);
+    for (int t = 0; t < TIMELINE_TILES; t++) {
+        assert(!timeline_is_dirty(&record, t));
+    }
+    
+    // A 40x40 patch inside tile (3, 2) marks only that tile, row-major
+    for (uint32_t y = 2 * 68 + 10; y < 2 * 68 + 50; y++) {
+        memset(img2 + (size_t)y * stride + (3 * 120 + 10) * BGRA_CHANNELS, 0xff,
+               40 * BGRA_CHANNELS);
+    }
+    calculate_mse_tiles_bgra(img1, img2, width, height, stride, stride,
+                             TIMELINE_TILES_X, TIMELINE_TILES_Y, tiles);
+    timeline_set_dirty(&record, tiles);
+    int dirty_tile = 2 * TIMELINE_TILES_X + 3;
+    for (int t = 0; t < TIMELINE_TILES; t++) {
+        assert(timeline_is_dirty(&record, t) == (t == dirty_tile));
+    }
+    assert(record.dirty[dirty_tile / 8] == 1u << (dirty_tile % 8));
+    
+    free(img1);
+    free(img2);
+    printf("PASSED\n");
+}
+
+int main() {
+    printf("Running record file, index and timeline tests...\n\n");
+    
+    assert(mkdtemp(dir) != NULL);
+    snprintf(index_path, sizeof(index_path), "%s/%s", dir, FRAME_INDEX_FILENAME);
+    
+    test_round_trip();
+    test_torn_tail();
+    test_foreign_layout();
+    test_query();
+    test_timeline_records();
+    test_timeline_dirty();
+    
+    remove_all();
+    rmdir(dir);
+    
+    printf("\nAll tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "timeline.h"
+#include "record-file.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int timeline_open_append(const char *directory) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, TIMELINE_FILENAME);
+    return record_file_open_append(path, TIMELINE_MAGIC, TIMELINE_VERSION,
+                                   sizeof(timeline_record_t));
+}
+
+int timeline_append(int fd, const timeline_record_t *record) {
+    // Records are small, so a single write() on an O_APPEND fd is atomic
+    ssize_t n = write(fd, record, sizeof(*record));
+    if (n < 0) {
+        return -errno;
+    }
+    return n == (ssize_t)sizeof(*record) ? 0 : -EIO;
+}
+
+int timeline_open(const char *path, timeline_t *timeline) {
+    memset(timeline, 0, sizeof(*timeline));
+    
+    record_file_t file;
+    int r = record_file_open(path, TIMELINE_MAGIC, TIMELINE_VERSION,
+                             sizeof(timeline_record_t), &file);
+    if (r < 0) {
+        return r;
+    }
+    
+    timeline->records = file.records;
+    timeline->count = file.count;
+    timeline->map = file.map;
+    timeline->map_size = file.map_size;
+    return 0;
+}
+
+void timeline_close(timeline_t *timeline) {
+    record_file_t file = { .map = timeline->map, .map_size = timeline->map_size };
+    record_file_close(&file);
+    memset(timeline, 0, sizeof(*timeline));
+}
+
+void timeline_set_dirty(timeline_record_t *record, const float *tile_mse) {
+    memset(record->dirty, 0, sizeof(record->dirty));
+    for (int t = 0; t < TIMELINE_TILES; t++) {
+        if (tile_mse[t] > TIMELINE_DIRTY_MSE) {
+            record->dirty[t >> 3] |= (uint8_t)(1u << (t & 7));
+        }
+    }
+}
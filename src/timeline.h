@@ -0,0 +1,64 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only record of every loop mode capture, saved or not.
+//
+// A record file (see record-file.h) of timeline_record_t in capture order,
+// readable through mmap like the similarity index.
+#define TIMELINE_FILENAME "timeline.fst"
+#define TIMELINE_MAGIC "FSTLINE1"
+#define TIMELINE_VERSION 1
+
+// Dirty tiles are tracked on a fixed grid over the frame
+#define TIMELINE_TILES_X 16
+#define TIMELINE_TILES_Y 16
+#define TIMELINE_TILES (TIMELINE_TILES_X * TIMELINE_TILES_Y)
+// Per-tile MSE a tile must exceed to count as dirty. At 1080p that is
+// roughly 0.1% of a tile's pixels fully changed, so a lone pixel or a
+// dithering gradient does not light it up
+#define TIMELINE_DIRTY_MSE 1e-3f
+
+#define TIMELINE_SAVED      (1u << 0) // Frame was written to disk
+#define TIMELINE_FIRST      (1u << 1) // Nothing to compare against yet
+#define TIMELINE_FAILED     (1u << 2) // Capture failed, no frame
+#define TIMELINE_TRIGGERED  (1u << 3) // Captured because of a --trigger event
+#define TIMELINE_RESIZED    (1u << 4) // Frame size differs from the last saved
+
+typedef struct {
+    int64_t timestamp_us;       // Wall clock at capture start, microseconds
+    uint32_t capture_us;        // D-Bus round trip and mapping of the frame
+    float similarity;           // Versus the last saved frame, -1 if none
+    uint32_t flags;             // TIMELINE_*
+    uint32_t reserved;
+    uint8_t dirty[TIMELINE_TILES / 8]; // Tiles that differ from the last saved frame (not the previous capture), row-major bits
+    char filename[32];          // Basename of the saved file, if SAVED
+} timeline_record_t;
+
+typedef struct {
+    const timeline_record_t *records;
+    size_t count;
+    void *map;
+    size_t map_size;
+} timeline_t;
+
+// Open <directory>/timeline.fst for appending. Returns an fd or -errno.
+int timeline_open_append(const char *directory);
+
+// Append one record. Returns 0 or -errno.
+int timeline_append(int fd, const timeline_record_t *record);
+
+// Map a timeline file read-only. Returns 0 or -errno.
+int timeline_open(const char *path, timeline_t *timeline);
+void timeline_close(timeline_t *timeline);
+
+// Mark tiles whose MSE is above TIMELINE_DIRTY_MSE in record->dirty
+void timeline_set_dirty(timeline_record_t *record, const float *tile_mse);
+
+static inline int timeline_is_dirty(const timeline_record_t *record, int tile) {
+    return (record->dirty[tile >> 3] >> (tile & 7)) & 1;
+}
+
+#endif // TIMELINE_H